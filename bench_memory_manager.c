@@ -0,0 +1,482 @@
+/*Petter Eriksson, 2024-10-04, git: Milloz-dev*, peer22@student.bth.se*/
+#define _GNU_SOURCE  // For wait4
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "memory_manager.h"
+#include "mem_histogram.h"
+
+/*Allocator benchmarks
+*
+*Runs standard allocator workloads on the memory manager and, as a baseline, on the system malloc:
+*
+*  churn       a thread replaces random blocks of one size in a small working set
+*  larson      random sizes, and every round each thread takes over the blocks of the next one (producer/consumer)
+*  threadtest  each thread allocates a batch of small blocks, then frees them all
+*  resize      blocks grow by half at a time until 64 KiB, then start over
+*  aging       random sizes over a large working set whose size mix drifts as the run goes on
+*
+*Every combination of allocator, benchmark and thread count runs in a process of its own, so it starts from a fresh
+*heap and its peak resident size is its own. One call in BENCH_SAMPLE is timed for the latency percentiles, so timing
+*hardly shows in the throughput. Results are printed as CSV or JSON, one row per run.
+*/
+#define BENCH_SAMPLE 8               // One call in this many is timed, a power of two
+#define BENCH_POOL_SIZE (64UL * 1024 * 1024)  // Pool the memory manager starts with, it grows 16 times that
+#define CHURN_SLOTS 256
+#define CHURN_SIZE 64
+#define LARSON_SLOTS 1000
+#define LARSON_ROUNDS 8
+#define THREADTEST_BLOCKS 1000
+#define THREADTEST_SIZE 64
+#define RESIZE_BLOCKS 8
+#define RESIZE_LIMIT (64 * 1024)
+#define AGING_SLOTS 4096
+#define AGING_PHASES 7
+
+/*Allocators
+*
+*What a benchmark allocates with. fragmentation is NULL for allocators that cannot tell.
+*/
+typedef struct {
+    const char* name;
+    void (*init)(size_t size, int threads);
+    void* (*alloc)(size_t size);
+    void (*free)(void* block);
+    void* (*resize)(void* block, size_t size);
+    double (*fragmentation)(void);
+    void (*deinit)(void);
+} Allocator;
+
+static void mm_init(size_t size, int threads) {
+    mem_options_t options = {.arenas = threads, .pages = MEM_PAGES_MMAP, .max_size = size * 16, .quiet = 1};
+    if (mem_init_with(size, &options) != 0) {
+        fprintf(stderr, "Error: Cannot create a pool of %zu bytes.\n", size);
+        exit(1);
+    }
+}
+
+static double mm_fragmentation(void) {
+    return mem_stats().fragmentation;
+}
+
+static void system_init(size_t size, int threads) {
+    (void)size;
+    (void)threads;
+}
+
+static void system_deinit(void) {
+}
+
+static const Allocator allocators[] = {
+    {"mm", mm_init, mem_alloc, mem_free, mem_resize, mm_fragmentation, mem_deinit},
+    {"glibc", system_init, malloc, free, realloc, NULL, system_deinit},
+};
+#define ALLOCATOR_COUNT (int)(sizeof(allocators) / sizeof(allocators[0]))
+
+/*Workers
+*
+*One per thread. Calls go through bench_alloc, bench_free and bench_resize, which count them, time one in
+*BENCH_SAMPLE and count the allocations that fail.
+*/
+typedef struct {
+    const Allocator* allocator;
+    int index;                              // Thread number
+    int threads;                            // Threads in the run
+    unsigned long long ops;                 // Calls to make
+    unsigned long long done;                // Calls made
+    unsigned long long failed;              // Allocations that returned NULL
+    unsigned long long latency[MEM_PROFILE_BUCKETS];  // Timed calls per bucket of nanoseconds
+    unsigned long long random;              // xorshift state
+    pthread_t thread;
+} Worker;
+
+static pthread_barrier_t run_barrier;       // Lines the threads up, at the start, between rounds and at the end
+static void*** larson_handoff;              // Slots each larson thread hands to the previous one
+static double run_fragmentation = -1.0;     // Measured by thread 0 before the blocks are freed, -1 if unknown
+
+static unsigned long long next_random(Worker* worker) {
+    worker->random ^= worker->random << 13;
+    worker->random ^= worker->random >> 7;
+    worker->random ^= worker->random << 17;
+    return worker->random;
+}
+
+// A random size in [low, high]
+static size_t random_size(Worker* worker, size_t low, size_t high) {
+    return low + (size_t)(next_random(worker) % (high - low + 1));
+}
+
+static void* bench_alloc(Worker* worker, size_t size) {
+    void* block;
+    if ((worker->done++ & (BENCH_SAMPLE - 1)) == 0) {
+        unsigned long long start = mem_now_ns();
+        block = worker->allocator->alloc(size);
+        worker->latency[mem_histogram_bucket(mem_now_ns() - start)]++;
+    } else {
+        block = worker->allocator->alloc(size);
+    }
+    if (block == NULL) {
+        worker->failed++;
+    }
+    return block;
+}
+
+// Empty slots are skipped, they would count as calls that cost nothing and how much differs between allocators
+static void bench_free(Worker* worker, void* block) {
+    if (block == NULL) {
+        return;
+    }
+    if ((worker->done++ & (BENCH_SAMPLE - 1)) == 0) {
+        unsigned long long start = mem_now_ns();
+        worker->allocator->free(block);
+        worker->latency[mem_histogram_bucket(mem_now_ns() - start)]++;
+    } else {
+        worker->allocator->free(block);
+    }
+}
+
+static void* bench_resize(Worker* worker, void* block, size_t size) {
+    void* resized;
+    if ((worker->done++ & (BENCH_SAMPLE - 1)) == 0) {
+        unsigned long long start = mem_now_ns();
+        resized = worker->allocator->resize(block, size);
+        worker->latency[mem_histogram_bucket(mem_now_ns() - start)]++;
+    } else {
+        resized = worker->allocator->resize(block, size);
+    }
+    if (resized == NULL) {
+        worker->failed++;
+    }
+    return resized;
+}
+
+// End of a benchmark: once every thread is done, thread 0 looks at the fragmentation, then all free what they hold
+static void bench_finish(Worker* worker, void** blocks, int count) {
+    pthread_barrier_wait(&run_barrier);
+    if (worker->index == 0 && worker->allocator->fragmentation != NULL) {
+        run_fragmentation = worker->allocator->fragmentation();
+    }
+    pthread_barrier_wait(&run_barrier);
+    for (int i = 0; i < count; i++) {
+        worker->allocator->free(blocks[i]);
+    }
+}
+
+/*Benchmarks
+*/
+static void bench_churn(Worker* worker) {
+    void* blocks[CHURN_SLOTS] = {NULL};
+    while (worker->done < worker->ops) {
+        int slot = (int)(next_random(worker) % CHURN_SLOTS);
+        bench_free(worker, blocks[slot]);
+        blocks[slot] = bench_alloc(worker, CHURN_SIZE);
+    }
+    bench_finish(worker, blocks, CHURN_SLOTS);
+}
+
+static void bench_larson(Worker* worker) {
+    void** blocks = (void**)calloc(LARSON_SLOTS, sizeof(void*));
+    for (int i = 0; i < LARSON_SLOTS; i++) {
+        blocks[i] = bench_alloc(worker, random_size(worker, 16, 1024));
+    }
+    for (int round = 0; round < LARSON_ROUNDS; round++) {
+        unsigned long long end = worker->ops / LARSON_ROUNDS * (unsigned long long)(round + 1);
+        while (worker->done < end) {
+            int slot = (int)(next_random(worker) % LARSON_SLOTS);
+            bench_free(worker, blocks[slot]);
+            blocks[slot] = bench_alloc(worker, random_size(worker, 16, 1024));
+        }
+        // Hand the blocks on, the next round frees what another thread allocated
+        larson_handoff[worker->index] = blocks;
+        pthread_barrier_wait(&run_barrier);
+        blocks = larson_handoff[(worker->index + 1) % worker->threads];
+        pthread_barrier_wait(&run_barrier);
+    }
+    bench_finish(worker, blocks, LARSON_SLOTS);
+    pthread_barrier_wait(&run_barrier);  // Every thread is done with the arrays before they go
+    free(larson_handoff[worker->index]);
+}
+
+static void bench_threadtest(Worker* worker) {
+    void* blocks[THREADTEST_BLOCKS];
+    while (worker->done < worker->ops) {
+        for (int i = 0; i < THREADTEST_BLOCKS; i++) {
+            blocks[i] = bench_alloc(worker, THREADTEST_SIZE);
+        }
+        for (int i = 0; i < THREADTEST_BLOCKS; i++) {
+            bench_free(worker, blocks[i]);
+        }
+    }
+    bench_finish(worker, blocks, 0);
+}
+
+static void bench_resize_growth(Worker* worker) {
+    void* blocks[RESIZE_BLOCKS] = {NULL};
+    size_t sizes[RESIZE_BLOCKS] = {0};
+    for (int i = 0; worker->done < worker->ops; i = (i + 1) % RESIZE_BLOCKS) {
+        if (blocks[i] == NULL || sizes[i] >= RESIZE_LIMIT) {
+            bench_free(worker, blocks[i]);
+            sizes[i] = 16;
+            blocks[i] = bench_alloc(worker, sizes[i]);
+        } else {
+            size_t size = sizes[i] + sizes[i] / 2;
+            void* resized = bench_resize(worker, blocks[i], size);
+            if (resized != NULL) {
+                blocks[i] = resized;
+                sizes[i] = size;
+            }
+        }
+        if (blocks[i] != NULL) {
+            ((char*)blocks[i])[sizes[i] - 1] = 1;  // Use the new tail, like a growing buffer would
+        }
+    }
+    bench_finish(worker, blocks, RESIZE_BLOCKS);
+}
+
+static void bench_aging(Worker* worker) {
+    void** blocks = (void**)calloc(AGING_SLOTS, sizeof(void*));
+    while (worker->done < worker->ops) {
+        // The sizes drift from 16-64 bytes up to 1-4 KiB, older blocks stay behind among the new ones
+        size_t phase = (size_t)(worker->done * AGING_PHASES / worker->ops);
+        int slot = (int)(next_random(worker) % AGING_SLOTS);
+        bench_free(worker, blocks[slot]);
+        blocks[slot] = bench_alloc(worker, random_size(worker, (size_t)16 << phase, (size_t)64 << phase));
+    }
+    bench_finish(worker, blocks, AGING_SLOTS);
+    free(blocks);
+}
+
+typedef struct {
+    const char* name;
+    void (*run)(Worker* worker);
+} Benchmark;
+
+static const Benchmark benchmarks[] = {
+    {"churn", bench_churn},
+    {"larson", bench_larson},
+    {"threadtest", bench_threadtest},
+    {"resize", bench_resize_growth},
+    {"aging", bench_aging},
+};
+#define BENCHMARK_COUNT (int)(sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+/*Runs
+*
+*A run happens in a child process, which sends its Result back through a pipe. The parent adds the peak resident
+*size from wait4.
+*/
+typedef struct {
+    unsigned long long ops;
+    unsigned long long failed;
+    double seconds;
+    unsigned long long p50, p99, p999;  // Nanoseconds
+    double fragmentation;               // -1 if the allocator cannot tell
+} Result;
+
+static const Benchmark* current_benchmark;  // What the workers of the run do
+
+static void* run_worker(void* arg) {
+    Worker* worker = (Worker*)arg;
+    pthread_barrier_wait(&run_barrier);
+    current_benchmark->run(worker);
+    return NULL;
+}
+
+static Result run_benchmark(const Allocator* allocator, const Benchmark* benchmark, int threads,
+                            unsigned long long ops, size_t pool_size) {
+    Result result;
+    memset(&result, 0, sizeof(result));
+    Worker* workers = (Worker*)calloc((size_t)threads, sizeof(Worker));
+    larson_handoff = (void***)calloc((size_t)threads, sizeof(void**));
+    current_benchmark = benchmark;
+    allocator->init(pool_size, threads);
+
+    pthread_barrier_init(&run_barrier, NULL, (unsigned)threads);
+    for (int i = 0; i < threads; i++) {
+        workers[i].allocator = allocator;
+        workers[i].index = i;
+        workers[i].threads = threads;
+        workers[i].ops = ops;
+        workers[i].random = 0x9E3779B97F4A7C15ULL * (unsigned long long)(i + 1);
+    }
+    unsigned long long start = mem_now_ns();
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+    }
+    unsigned long long latency[MEM_PROFILE_BUCKETS] = {0};
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        result.ops += workers[i].done;
+        result.failed += workers[i].failed;
+        for (int b = 0; b < MEM_PROFILE_BUCKETS; b++) {
+            latency[b] += workers[i].latency[b];
+        }
+    }
+    result.seconds = (double)(mem_now_ns() - start) / 1e9;
+    result.p50 = mem_histogram_percentile(latency, 0.5);
+    result.p99 = mem_histogram_percentile(latency, 0.99);
+    result.p999 = mem_histogram_percentile(latency, 0.999);
+    result.fragmentation = run_fragmentation;
+
+    pthread_barrier_destroy(&run_barrier);
+    allocator->deinit();
+    free(larson_handoff);
+    free(workers);
+    return result;
+}
+
+// Run in a child process; returns 0 on success, with the peak resident size in KiB
+static int run_isolated(const Allocator* allocator, const Benchmark* benchmark, int threads, unsigned long long ops,
+                        size_t pool_size, Result* result, long* peak_rss) {
+    int channel[2];
+    if (pipe(channel) != 0) {
+        return -1;
+    }
+    fflush(stdout);
+    pid_t child = fork();
+    if (child < 0) {
+        close(channel[0]);
+        close(channel[1]);
+        return -1;
+    }
+    if (child == 0) {
+        close(channel[0]);
+        Result measured = run_benchmark(allocator, benchmark, threads, ops, pool_size);
+        ssize_t written = write(channel[1], &measured, sizeof(measured));
+        _exit(written == (ssize_t)sizeof(measured) ? 0 : 1);
+    }
+    close(channel[1]);
+    ssize_t received = read(channel[0], result, sizeof(Result));
+    close(channel[0]);
+
+    int status;
+    struct rusage usage;
+    if (wait4(child, &status, 0, &usage) != child || !WIFEXITED(status) || WEXITSTATUS(status) != 0 ||
+        received != (ssize_t)sizeof(Result)) {
+        return -1;
+    }
+    *peak_rss = usage.ru_maxrss;
+    return 0;
+}
+
+static void usage(const char* name) {
+    fprintf(stderr, "Usage: %s [-f csv|json] [-a mm|glibc|both] [-b benchmark,...] [-t threads,...] "
+                    "[-n calls per thread] [-s pool bytes]\n", name);
+    fprintf(stderr, "Benchmarks: churn, larson, threadtest, resize, aging (default all)\n");
+    exit(1);
+}
+
+// Is name one of the comma-separated entries of list (or is list NULL)?
+static int listed(const char* list, const char* name) {
+    if (list == NULL) {
+        return 1;
+    }
+    size_t length = strlen(name);
+    for (const char* entry = list; entry != NULL; entry = strchr(entry, ',') ? strchr(entry, ',') + 1 : NULL) {
+        if (strncmp(entry, name, length) == 0 && (entry[length] == ',' || entry[length] == '\0')) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    int json = 0;
+    const char* allocator_list = NULL;
+    const char* benchmark_list = NULL;
+    const char* thread_list = "1,2,4,8";
+    unsigned long long ops = 1000000;
+    size_t pool_size = BENCH_POOL_SIZE;
+
+    int option;
+    while ((option = getopt(argc, argv, "f:a:b:t:n:s:")) != -1) {
+        switch (option) {
+        case 'f':
+            if (strcmp(optarg, "csv") != 0 && strcmp(optarg, "json") != 0) {
+                usage(argv[0]);
+            }
+            json = strcmp(optarg, "json") == 0;
+            break;
+        case 'a':
+            allocator_list = strcmp(optarg, "both") == 0 ? NULL : optarg;
+            break;
+        case 'b':
+            benchmark_list = optarg;
+            break;
+        case 't':
+            thread_list = optarg;
+            break;
+        case 'n':
+            ops = strtoull(optarg, NULL, 0);
+            break;
+        case 's':
+            pool_size = (size_t)strtoull(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc || ops == 0 || pool_size == 0) {
+        usage(argv[0]);
+    }
+
+    if (json) {
+        printf("[\n");
+    } else {
+        printf("allocator,benchmark,threads,ops,seconds,ops_per_sec,p50_ns,p99_ns,p999_ns,peak_rss_kb,fragmentation,failed\n");
+    }
+    int rows = 0;
+    int errors = 0;
+    for (int b = 0; b < BENCHMARK_COUNT; b++) {
+        if (!listed(benchmark_list, benchmarks[b].name)) {
+            continue;
+        }
+        for (const char* entry = thread_list; entry != NULL; entry = strchr(entry, ',') ? strchr(entry, ',') + 1 : NULL) {
+            int threads = atoi(entry);
+            if (threads < 1) {
+                usage(argv[0]);
+            }
+            for (int a = 0; a < ALLOCATOR_COUNT; a++) {
+                if (!listed(allocator_list, allocators[a].name)) {
+                    continue;
+                }
+                Result result;
+                long peak_rss = 0;
+                if (run_isolated(&allocators[a], &benchmarks[b], threads, ops, pool_size, &result, &peak_rss) != 0) {
+                    fprintf(stderr, "Error: %s %s with %d threads did not finish.\n", allocators[a].name,
+                            benchmarks[b].name, threads);
+                    errors++;
+                    continue;
+                }
+                double rate = result.seconds > 0 ? (double)result.ops / result.seconds : 0.0;
+                if (json) {
+                    printf("%s  {\"allocator\": \"%s\", \"benchmark\": \"%s\", \"threads\": %d, \"ops\": %llu, "
+                           "\"seconds\": %.6f, \"ops_per_sec\": %.0f, \"p50_ns\": %llu, \"p99_ns\": %llu, "
+                           "\"p999_ns\": %llu, \"peak_rss_kb\": %ld, \"fragmentation\": ",
+                           rows > 0 ? ",\n" : "", allocators[a].name, benchmarks[b].name, threads, result.ops,
+                           result.seconds, rate, result.p50, result.p99, result.p999, peak_rss);
+                    if (result.fragmentation < 0) {
+                        printf("null");
+                    } else {
+                        printf("%.4f", result.fragmentation);
+                    }
+                    printf(", \"failed\": %llu}", result.failed);
+                } else {
+                    printf("%s,%s,%d,%llu,%.6f,%.0f,%llu,%llu,%llu,%ld,", allocators[a].name, benchmarks[b].name,
+                           threads, result.ops, result.seconds, rate, result.p50, result.p99, result.p999, peak_rss);
+                    if (result.fragmentation >= 0) {
+                        printf("%.4f", result.fragmentation);
+                    }
+                    printf(",%llu\n", result.failed);
+                }
+                rows++;
+            }
+        }
+    }
+    if (json) {
+        printf("%s]\n", rows > 0 ? "\n" : "");
+    }
+    return errors > 0 ? 1 : 0;
+}
@@ -1,190 +1,395 @@
 #define _GNU_SOURCE
 #include <dlfcn.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
+#include "malloc_trace.h"
 
-char tmpbuff[1024];
-unsigned long tmppos = 0;
-unsigned long tmpallocs = 0;
+/*Allocation tracer
+*
+*Preload this library (LD_PRELOAD=./libmalloc_trace.so program) to record every malloc, free, calloc, realloc,
+*memalign, mmap and munmap of a program as binary records (see malloc_trace.h) in the file named by MM_TRACE_FILE,
+*malloc_trace.<pid>.bin by default. trace_decode turns the file into text or CSV.
+*
+*A call only appends a record to a buffer of its own thread, without locks or system calls. A writer thread empties
+*the buffers into the file every TRACE_FLUSH_NS, straight from the buffers. A thread that fills its buffer before
+*the writer comes by writes it out itself, so no record is lost; its calls wait for the file meanwhile.
+*Frees are recorded before the block goes back and allocations after they got it, so the order of the timestamps is
+*an order the blocks really changed hands in (see malloc_trace.h). A forked child is not traced until it execs.
+*/
+#define TRACE_RING_RECORDS 65536       // Records a thread can have waiting for the writer (3 MiB), a power of two
+#define TRACE_FLUSH_NS 5000000         // How often the writer thread empties the buffers
+#define TRACE_BOOT_BYTES 4096          // Bytes for allocations made while the real functions are looked up
 
-void *memset(void*,int,size_t);
-void *memmove(void *to, const void *from, size_t size);
+_Static_assert((TRACE_RING_RECORDS & (TRACE_RING_RECORDS - 1)) == 0, "TRACE_RING_RECORDS must be a power of two");
+
+/*Trace buffer
+*
+*A single-producer, single-consumer ring: the owning thread only moves head, the writer only moves tail. Buffers are
+*never unmapped; when a thread exits its buffer is handed to the next new thread, records still in it and all.
+*/
+typedef struct TraceRing {
+    uint64_t head;                      // Records added so far
+    uint32_t thread;                    // Kernel id of the owner
+    int owned;                          // 1 while a thread is adding to the buffer
+    struct TraceRing* next;             // Next buffer
+    _Alignas(64) uint64_t tail;         // Records written to the file so far, on a line of its own
+    _Alignas(64) trace_record_t records[TRACE_RING_RECORDS];
+} TraceRing;
+
+static TraceRing* rings = NULL;                 // All buffers, pushed on the front
+static int trace_fd = -1;                       // Trace file, -1 while not tracing
+static int trace_stopped = 0;                   // Set at exit: the writer is gone, calls write their records at once
+static pthread_t trace_writer_thread;
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;  // Serializes writing to the file
+static pthread_key_t ring_key;
+
+// initial-exec, so reaching these never allocates
+static __thread TraceRing* thread_ring __attribute__((tls_model("initial-exec"))) = NULL;
+static __thread int in_tracer __attribute__((tls_model("initial-exec"))) = 0;  // Calls made by the tracer itself
+
+static char boot_buffer[TRACE_BOOT_BYTES];
+static size_t boot_used = 0;
 
 /*=========================================================
  * interception points
  */
 
-static void * (*myfn_calloc)(size_t nmemb, size_t size);
-static void * (*myfn_malloc)(size_t size);
-static void   (*myfn_free)(void *ptr);
-static void * (*myfn_realloc)(void *ptr, size_t size);
-static void * (*myfn_memalign)(size_t blocksize, size_t bytes);
-static void * (*myfn_mmap)(void *ptr,  size_t length, int prot, int flags, int fd, off_t offset);
-static int (*myfn_munmap)(void *ptr, size_t length);
-
-
-static void init(){
-  myfn_malloc     = dlsym(RTLD_NEXT, "malloc");
-  myfn_free       = dlsym(RTLD_NEXT, "free");
-  myfn_calloc     = dlsym(RTLD_NEXT, "calloc");
-  myfn_realloc    = dlsym(RTLD_NEXT, "realloc");
-  myfn_memalign   = dlsym(RTLD_NEXT, "memalign");
-  myfn_mmap       = dlsym(RTLD_NEXT, "mmap");
-  myfn_munmap     = dlsym(RTLD_NEXT, "munmap");
-  
-  if (!myfn_malloc || !myfn_free || !myfn_calloc || !myfn_realloc || !myfn_memalign || !myfn_mmap || !myfn_munmap ) 
-    {
-      fprintf(stderr, "Error in `dlsym`: %s\n", dlerror());
-      exit(1);
-    }
-}
-
-void *malloc(size_t size){
-
-  static int initializing = 0;
-  if (myfn_malloc == NULL){
-    if (!initializing){
-      initializing = 1;
-      init();
-      initializing = 0;
-      fprintf(stdout, "rMALLOC(%lu)\n", size);      
-      fprintf(stdout, "jcheck: allocated %lu bytes of temp memory in %lu chunks during initialization\n", tmppos, tmpallocs);
-    }
-    else {
-      if (tmppos + size < sizeof(tmpbuff)) {
-	void *retptr = tmpbuff + tmppos;
-	tmppos += size;
-	++tmpallocs;
-	return retptr;
-      }
-      else {
-	fprintf(stdout, "jcheck: too much memory requested during initialisation - increase tmpbuff size\n");
-	exit(1);
-      }
-    }
-  }
-
-  void *ptr = myfn_malloc(size);
-  char buffer[50];
-  int len=sprintf(buffer,"rMALLOc (%ld) at %p\n",size,ptr);
-  write(1,buffer,len);
-  return ptr;
-}
-
-void free(void *ptr){
-  // something wrong if we call free before one of the allocators!
-  //  if (myfn_malloc == NULL)
-  //      init();
-  
-  if (ptr >= (void*) tmpbuff && ptr <= (void*)(tmpbuff + tmppos))
-    fprintf(stdout, "freeing temp memory\n");
-  else
-    myfn_free(ptr);
-
-  char buffer[50];
-  int len=sprintf(buffer,"rFREE at %p\n",ptr);
-  write(1,buffer,len);
-}
-
-void *realloc(void *ptr, size_t size)
-{
-  char buffer[70];
-  int len=sprintf(buffer,"rREALLOC-> (%ld) at %p \n",size,ptr);
-  write(1,buffer,len);
-    if (myfn_malloc == NULL)
-    {
-        void *nptr = malloc(size);
-        if (nptr && ptr)
-        {
-            memmove(nptr, ptr, size);
-            free(ptr);
+static void* (*real_calloc)(size_t nmemb, size_t size);
+static void* (*real_malloc)(size_t size);
+static void (*real_free)(void* ptr);
+static void* (*real_realloc)(void* ptr, size_t size);
+static void* (*real_memalign)(size_t alignment, size_t size);
+static void* (*real_mmap)(void* ptr, size_t length, int prot, int flags, int fd, off_t offset);
+static int (*real_munmap)(void* ptr, size_t length);
+
+// Look up the functions being wrapped; dlsym may allocate, which boot_alloc serves meanwhile
+static void resolve(void) {
+    static int resolving = 0;
+    if (resolving) {
+        return;
+    }
+    resolving = 1;
+    // Through void** since ISO C has no conversion from void* to a function pointer
+    *(void**)&real_malloc = dlsym(RTLD_NEXT, "malloc");
+    *(void**)&real_free = dlsym(RTLD_NEXT, "free");
+    *(void**)&real_calloc = dlsym(RTLD_NEXT, "calloc");
+    *(void**)&real_realloc = dlsym(RTLD_NEXT, "realloc");
+    *(void**)&real_memalign = dlsym(RTLD_NEXT, "memalign");
+    *(void**)&real_mmap = dlsym(RTLD_NEXT, "mmap");
+    *(void**)&real_munmap = dlsym(RTLD_NEXT, "munmap");
+    if (!real_malloc || !real_free || !real_calloc || !real_realloc || !real_memalign || !real_mmap || !real_munmap) {
+        fprintf(stderr, "Error in `dlsym`: %s\n", dlerror());
+        exit(1);
+    }
+    resolving = 0;
+}
+
+static void* boot_alloc(size_t size) {
+    size = (size + 15) & ~(size_t)15;
+    if (boot_used + size > sizeof(boot_buffer)) {
+        fprintf(stderr, "Error: Too much memory requested during initialization, increase TRACE_BOOT_BYTES.\n");
+        exit(1);
+    }
+    void* block = boot_buffer + boot_used;
+    boot_used += size;
+    return block;
+}
+
+static int is_boot(void* ptr) {
+    return (char*)ptr >= boot_buffer && (char*)ptr < boot_buffer + sizeof(boot_buffer);
+}
+
+/*=========================================================
+ * recording
+ */
+
+// Buffer of an exiting thread goes to the next new thread
+static void ring_release(void* ring) {
+    thread_ring = NULL;
+    __atomic_store_n(&((TraceRing*)ring)->owned, 0, __ATOMIC_RELEASE);
+}
+
+// Take a buffer left by a thread that exited, or map a new one
+static TraceRing* ring_acquire(void) {
+    TraceRing* ring;
+    for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+        int free_ring = 0;
+        if (__atomic_compare_exchange_n(&ring->owned, &free_ring, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    if (ring == NULL) {
+        ring = real_mmap(NULL, sizeof(TraceRing), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ring == MAP_FAILED) {
+            return NULL;
+        }
+        ring->owned = 1;
+        ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+    }
+    ring->thread = (uint32_t)syscall(SYS_gettid);
+    pthread_setspecific(ring_key, ring);
+    thread_ring = ring;
+    return ring;
+}
+
+static uint64_t trace_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+static void ring_push(TraceRing* ring, uint64_t head, trace_op_t op, uint64_t ptr, uint64_t size, uint64_t arg,
+                      uint64_t start) {
+    trace_record_t* record = &ring->records[head & (TRACE_RING_RECORDS - 1)];
+    record->timestamp = trace_now();
+    record->start = start != 0 ? start : record->timestamp;
+    record->ptr = ptr;
+    record->size = size;
+    record->arg = arg;
+    record->thread = ring->thread;
+    record->op = op;
+}
+
+static void trace_flush(void);
+static void ring_flush(TraceRing* ring);
+
+// Append a record for one call to the calling thread's buffer, start is when the call was made (0: now)
+static void trace(trace_op_t op, void* ptr, size_t size, uint64_t arg, uint64_t start) {
+    if (__atomic_load_n(&trace_fd, __ATOMIC_RELAXED) < 0 || in_tracer) {
+        return;
+    }
+    TraceRing* ring = thread_ring;
+    if (ring == NULL) {
+        in_tracer = 1;
+        ring = ring_acquire();
+        in_tracer = 0;
+        if (ring == NULL) {
+            return;
         }
-        return nptr;
     }
 
-    void *nptr = myfn_realloc(ptr, size);
+    uint64_t head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == TRACE_RING_RECORDS) {
+        // The writer is not keeping up, wait for the file rather than lose records
+        in_tracer = 1;
+        pthread_mutex_lock(&flush_lock);
+        ring_flush(ring);
+        pthread_mutex_unlock(&flush_lock);
+        in_tracer = 0;
+    }
+    ring_push(ring, head, op, (uint64_t)(uintptr_t)ptr, size, arg, start);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    if (__atomic_load_n(&trace_stopped, __ATOMIC_RELAXED)) {
+        in_tracer = 1;
+        trace_flush();
+        in_tracer = 0;
+    }
+}
+
+static void write_all(const void* data, size_t bytes) {
+    while (bytes > 0) {
+        ssize_t written = write(trace_fd, data, bytes);
+        if (written <= 0) {
+            return;  // Nowhere to put the trace, nothing to tell the program
+        }
+        data = (const char*)data + written;
+        bytes -= (size_t)written;
+    }
+}
+
+// Write out everything one buffer holds, in as few writes as the wrap-around allows. Called with flush_lock held.
+static void ring_flush(TraceRing* ring) {
+    uint64_t tail = ring->tail;
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    while (tail < head) {
+        uint64_t start = tail & (TRACE_RING_RECORDS - 1);
+        uint64_t count = head - tail < TRACE_RING_RECORDS - start ? head - tail : TRACE_RING_RECORDS - start;
+        write_all(&ring->records[start], count * sizeof(trace_record_t));
+        tail += count;
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+}
+
+// Write out everything the buffers hold
+static void trace_flush(void) {
+    pthread_mutex_lock(&flush_lock);
+    for (TraceRing* ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+        ring_flush(ring);
+    }
+    pthread_mutex_unlock(&flush_lock);
+}
 
+static void* trace_writer(void* unused) {
+    (void)unused;
+    in_tracer = 1;
+    struct timespec pause = {0, TRACE_FLUSH_NS};
+    while (!__atomic_load_n(&trace_stopped, __ATOMIC_ACQUIRE)) {
+        nanosleep(&pause, NULL);
+        trace_flush();
+    }
+    return NULL;
+}
 
-    len=sprintf(buffer,"rREALLOC (%ld) at %p -> %p\n",size,ptr,nptr);
-    write(1,buffer,len);
-    return nptr;
+// The child of a fork has no writer thread, and must not write to the parent's file
+static void trace_fork_child(void) {
+    int fd = trace_fd;
+    __atomic_store_n(&trace_fd, -1, __ATOMIC_RELAXED);
+    if (fd >= 0) {
+        close(fd);
+    }
 }
 
-void *calloc(size_t nmemb, size_t size)
-{
-    if (myfn_malloc == NULL)
-    {
-        void *ptr = malloc(nmemb*size);
-        if (ptr)
-            memset(ptr, 0, nmemb*size);
-        return ptr;
+static void __attribute__((constructor)) trace_start(void) {
+    if (real_malloc == NULL) {
+        resolve();
+    }
+
+    char path[4096];
+    const char* name = getenv("MM_TRACE_FILE");
+    if (name != NULL && name[0] != '\0') {
+        snprintf(path, sizeof(path), "%s", name);
+    } else {
+        snprintf(path, sizeof(path), "malloc_trace.%d.bin", (int)getpid());
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Warning: Could not open trace file %s, not tracing.\n", path);
+        return;
+    }
+
+    in_tracer = 1;
+    pthread_key_create(&ring_key, ring_release);
+    pthread_atfork(NULL, NULL, trace_fork_child);
+
+    trace_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.record_size = sizeof(trace_record_t);
+    header.pid = (uint32_t)getpid();
+    header.start = trace_now();
+    trace_fd = fd;
+    write_all(&header, sizeof(header));
+
+    if (pthread_create(&trace_writer_thread, NULL, trace_writer, NULL) != 0) {
+        fprintf(stderr, "Warning: Could not start the trace writer, not tracing.\n");
+        trace_fd = -1;
+        close(fd);
+    }
+    in_tracer = 0;
+}
+
+// Stop the writer and write what is left, calls made from here on write their records themselves
+static void __attribute__((destructor)) trace_stop(void) {
+    if (trace_fd < 0) {
+        return;
+    }
+    __atomic_store_n(&trace_stopped, 1, __ATOMIC_RELEASE);
+    pthread_join(trace_writer_thread, NULL);
+    trace_flush();
+}
+
+/*=========================================================
+ * wrappers
+ */
+
+void* malloc(size_t size) {
+    if (real_malloc == NULL) {
+        resolve();
+        if (real_malloc == NULL) {
+            return boot_alloc(size);  // Called from dlsym
+        }
     }
+    void* ptr = real_malloc(size);
+    trace(TRACE_MALLOC, ptr, size, 0, 0);
+    return ptr;
+}
 
-    void *ptr = myfn_calloc(nmemb, size);
+void free(void* ptr) {
+    if (ptr == NULL || is_boot(ptr)) {
+        return;  // Boot memory is never reused
+    }
+    if (real_free == NULL) {
+        resolve();
+        if (real_free == NULL) {
+            return;  // Called from dlsym with memory it did not get from us, leak it
+        }
+    }
+    // Recorded first: once it is back, another thread may get the block and record that
+    trace(TRACE_FREE, ptr, 0, 0, 0);
+    real_free(ptr);
+}
 
-    char buffer[70];
-    int len=sprintf(buffer,"rCALLOC (%ld,%ld) \n",nmemb, size);
-    write(1,buffer,len);
-    
+void* calloc(size_t nmemb, size_t size) {
+    if (real_calloc == NULL) {
+        resolve();
+        if (real_calloc == NULL) {
+            if (size != 0 && nmemb > (size_t)-1 / size) {
+                return NULL;
+            }
+            return boot_alloc(nmemb * size);  // The boot buffer is still all zero
+        }
+    }
+    void* ptr = real_calloc(nmemb, size);
+    trace(TRACE_CALLOC, ptr, nmemb * size, nmemb, 0);
     return ptr;
 }
 
-void *memalign(size_t blocksize, size_t bytes)
-{
-    void *ptr = myfn_memalign(blocksize, bytes);
+void* realloc(void* ptr, size_t size) {
+    if (real_realloc == NULL) {
+        resolve();
+    }
+    if (real_realloc == NULL || is_boot(ptr)) {
+        // Boot blocks do not know their size, copy what there may be
+        void* moved = malloc(size);
+        if (moved != NULL && ptr != NULL) {
+            size_t left = (size_t)(boot_buffer + sizeof(boot_buffer) - (char*)ptr);
+            memcpy(moved, ptr, size < left ? size : left);
+        }
+        return moved;
+    }
+    // The old block may go back during the call and the new one is only ours after it, so both times are kept
+    uint64_t start = trace_now();
+    void* moved = real_realloc(ptr, size);
+    trace(TRACE_REALLOC, moved, size, (uint64_t)(uintptr_t)ptr, start);
+    return moved;
+}
 
-    char buffer[70];
-    int len=sprintf(buffer,"rMEMALING (%ld, %ld) @ %p\n",blocksize, bytes,ptr);
-    write(1,buffer,len);
-    
+void* memalign(size_t alignment, size_t size) {
+    if (real_memalign == NULL) {
+        resolve();
+    }
+    void* ptr = real_memalign(alignment, size);
+    trace(TRACE_MEMALIGN, ptr, size, alignment, 0);
     return ptr;
 }
 
-void *mmap(void *ptr,  size_t length, int prot, int flags, int fd, off_t offset)
-{
-  static int initializing = 0;
-  if (myfn_mmap == NULL) {
-    if (!initializing){
-      initializing = 1;
-      init();
-      initializing = 0;
-      fprintf(stdout, "rMMAP(%lu)\n", length);      
-      fprintf(stdout, "jcheck: allocated %lu bytes of temp memory in %lu chunks during initialization\n", tmppos, tmpallocs);
-    }
-    else {
-     if (tmppos + length < sizeof(tmpbuff)) {
-	void *retptr = tmpbuff + tmppos;
-	tmppos += length;
-	++tmpallocs;
-	return retptr;
-      }
-      else {
-	fprintf(stdout, "jcheck: too much memory requested during initialisation - increase tmpbuff size\n");
-	exit(1);
-      }
-    }
-  }
-  void *ptr2 = myfn_mmap(ptr, length, prot, flags, fd, offset);
-    
-  char buffer[70];
-  int len=sprintf(buffer,"rMMAP (%ld) at %p\n", length, ptr2);
-  write(1,buffer,len);
-  
-  return ptr2;
-}
-
-
-int munmap(void *ptr, size_t length){
-  char buffer[70];
-  int len=sprintf(buffer,"rMUNMMAP-> (%p,%ld) => \n",ptr, length);
-  write(1,buffer,len);
-  
-  int resp=myfn_munmap(ptr, length);
-
-  len=sprintf(buffer,"rMUNMMAP (%p,%ld) => %d\n",ptr, length, resp);
-  write(1,buffer,len);
-
-  return resp;
-}
\ No newline at end of file
+void* mmap(void* ptr, size_t length, int prot, int flags, int fd, off_t offset) {
+    if (real_mmap == NULL) {
+        resolve();
+    }
+    void* mapped = real_mmap(ptr, length, prot, flags, fd, offset);
+    trace(TRACE_MMAP, mapped, length, 0, 0);
+    return mapped;
+}
+
+int munmap(void* ptr, size_t length) {
+    if (real_munmap == NULL) {
+        resolve();
+    }
+    uint64_t start = trace_now();
+    int result = real_munmap(ptr, length);
+    trace(TRACE_MUNMAP, ptr, length, (uint64_t)(int64_t)result, start);
+    return result;
+}
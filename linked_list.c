@@ -3,22 +3,128 @@
 
 pthread_mutex_t list_lock;
 
+// Nodes are fixed-size, so they come from a slab in the memory pool. The slab takes them from the pool in chunks of up
+// to 4096 nodes, one allocation each, which batches list construction further than mem_alloc_many could (that still
+// gives every node a block header of its own). list_cleanup hands the chunks back with mem_free_many.
+static mem_slab_t* node_slab = NULL;
+
+// What a list kept in a pool file leaves there, to be found again through the pool root
+typedef struct ListRoot {
+    Node* head;
+    mem_slab_t* slab;
+} ListRoot;
+
+static ListRoot* list_root = NULL;  // Root of the open persistent list, NULL otherwise
+
+// A node from the slab, which is created on first use after list_cleanup so the list can be used again
+static Node* node_alloc(void) {
+    if (node_slab == NULL) {
+        node_slab = mem_slab_create(sizeof(Node));
+    }
+    return (Node*)mem_slab_alloc(node_slab);
+}
+
 /*Initialization function
 *
-*This function sets up the list and prepares it for operations.
+*This function sets up the list and prepares it for operations. It refuses while a persistent list is open: that
+*list's nodes and slab are in its file, and only list_close knows its head to save. The open list stays usable.
 */
 void list_init(Node** head, size_t size) {
 
     pthread_mutex_lock(&list_lock);
 
+    if (list_root != NULL) {
+        printf("Error: A persistent list is open, close it with list_close first.\n");
+        pthread_mutex_unlock(&list_lock);
+        return;
+    }
+
+    // Drop the slab of a list that was never cleaned up before its pool goes away
+    mem_slab_destroy(node_slab);
+
     // Initialize the memory manager with the specified size of memory pool
     mem_init(size);
+    node_slab = mem_slab_create(sizeof(Node));
     *head = NULL;  // Initialize the list head to NULL (empty list)
 
     // Unlock after init
     pthread_mutex_unlock(&list_lock);
 }
 
+/*Persistent lists
+*
+*list_open keeps the list in the pool file at path: the nodes, their slab and the head are all in the file, so a list
+*saved by list_close is back as it was with a single mmap, without inserting any node again. If the pool had to be
+*mapped somewhere new, the links are moved along with it in one walk. A new file starts out empty. list_cleanup
+*empties the file for good. Returns 0, or -1 with the list closed if the file cannot be opened or has no room.
+*/
+int list_open(Node** head, size_t size, const char* path) {
+
+    pthread_mutex_lock(&list_lock);
+
+    mem_slab_destroy(node_slab);
+    node_slab = NULL;
+
+    mem_options_t options = {.file = path};
+    if (mem_init_with(size, &options) != 0) {
+        *head = NULL;
+        pthread_mutex_unlock(&list_lock);
+        return -1;
+    }
+    list_root = (ListRoot*)mem_root();
+    if (list_root == NULL) {
+        list_root = (ListRoot*)mem_alloc(sizeof(ListRoot));
+        mem_slab_t* slab = list_root != NULL ? mem_slab_create(sizeof(Node)) : NULL;
+        if (slab == NULL) {
+            // No room for the list itself: leave the file as it was and the list closed
+            printf("Error: Memory pool too small for a list in %s.\n", path);
+            mem_free(list_root);
+            list_root = NULL;
+            *head = NULL;
+            mem_deinit();
+            pthread_mutex_unlock(&list_lock);
+            return -1;
+        }
+        list_root->head = NULL;
+        list_root->slab = slab;
+        mem_set_root(list_root);
+    } else if (mem_moved() != 0) {
+        // The root came along, the pointers the list keeps in its nodes did not
+        ptrdiff_t moved = mem_moved();
+        list_root->slab = (mem_slab_t*)((char*)list_root->slab + moved);
+        Node** link = &list_root->head;
+        while (*link != NULL) {
+            *link = (Node*)((char*)*link + moved);
+            link = &(*link)->next;
+        }
+    }
+    node_slab = list_root->slab;
+    *head = list_root->head;
+
+    pthread_mutex_unlock(&list_lock);
+    return 0;
+}
+
+void list_close(Node** head) {
+
+    pthread_mutex_lock(&list_lock);
+
+    // Leave the head where list_open finds it, then write the pool back to its file
+    if (list_root == NULL) {
+        // list_open failed, there is nothing to write back
+        *head = NULL;
+        pthread_mutex_unlock(&list_lock);
+        return;
+    }
+    list_root->head = *head;
+    list_root = NULL;
+    node_slab = NULL;
+    *head = NULL;
+    mem_deinit();
+
+    pthread_mutex_unlock(&list_lock);
+}
+
 /*Insertion function(s)
 *
 *Adds a new node with the specified data to the linked list. The new node will be added after the last node,
@@ -29,7 +135,7 @@ void list_insert(Node** head, uint16_t data) {
     pthread_mutex_lock(&list_lock);
 
     // Allocate memory for the new node
-    Node* new_node = (Node*)mem_alloc(sizeof(Node));
+    Node* new_node = node_alloc();
     if (new_node == NULL) {
         printf("Error: Memory alloc for new node failed.\n");
         // Unlock before return
@@ -71,7 +177,7 @@ void list_insert_after(Node* prev_node, uint16_t data){
     }
 
     // Allocate memory for the new node
-    Node* new_node = (Node*)mem_alloc(sizeof(Node));
+    Node* new_node = node_alloc();
     if (new_node == NULL) {
         printf("Error: Memory allocation for new node failed.\n");
         // Unlock before return
@@ -105,7 +211,7 @@ void list_insert_before(Node** head, Node* next_node, uint16_t data){
     }
 
     // Allocate memory for the new node
-    Node* new_node = (Node*)mem_alloc(sizeof(Node));
+    Node* new_node = node_alloc();
     if (new_node == NULL) {
         printf("Error: Memory allocation for new node failed.\n");
         // Unlock before return
@@ -133,7 +239,7 @@ void list_insert_before(Node** head, Node* next_node, uint16_t data){
     // Check if the previous node was found
     if (current == NULL) {
         printf("Error: next_node not found in the list.\n");
-        mem_free(new_node); // Free allocated memory for new node
+        mem_slab_free(node_slab, new_node); // Free allocated memory for new node
         // Unlock before return
         pthread_mutex_unlock(&list_lock);
         return;
@@ -170,7 +276,7 @@ void list_delete(Node** head, uint16_t data) {
         // If the node to be deleted is the head
         if (prev == NULL && current->data == data) {
             *head = current->next; // Update head to point to the next node
-            mem_free(current); // Free the memory of the old head node
+            mem_slab_free(node_slab, current); // Free the memory of the old head node
             pthread_mutex_unlock(&list_lock); // Unlock before return
             return;
         }
@@ -178,7 +284,7 @@ void list_delete(Node** head, uint16_t data) {
         // If current node's data matches the target
         if (current->data == data) {
             prev->next = current->next; // Bypass the node to be deleted
-            mem_free(current); // Free the memory of the node
+            mem_slab_free(node_slab, current); // Free the memory of the node
             pthread_mutex_unlock(&list_lock); // Unlock after deletion
             return;
         }
@@ -305,14 +411,15 @@ void list_cleanup(Node** head){
     // Lock the list to prevent modifications from other threads
     pthread_mutex_lock(&list_lock);
 
-    Node* current = *head; // Start with the head of the list
-    Node* next = NULL; // Pointer to store the next node
+    // Every node lives in the slab, so destroying it frees them all, handing its chunks back in one batch
+    mem_slab_destroy(node_slab);
+    node_slab = NULL;
 
-    // Traverse the list and free each node's memory
-    while (current != NULL) {
-        next = current->next; // Save the next node before freeing the current
-        mem_free(current);
-        current = next; // Next
+    // A persistent list leaves nothing behind in its file
+    if (list_root != NULL) {
+        mem_free(list_root);
+        mem_set_root(NULL);
+        list_root = NULL;
     }
 
     *head = NULL;  // Reset the head pointer to NULL after cleanup
@@ -320,4 +427,4 @@ void list_cleanup(Node** head){
 
     // Unlock list after cleanup
     pthread_mutex_unlock(&list_lock); 
-}
\ No newline at end of file
+}
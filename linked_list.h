@@ -17,6 +17,8 @@ extern pthread_mutex_t list_lock;  // Declare it as extern
 
 // Declare functions
 void list_init(Node** head, size_t size);
+int list_open(Node** head, size_t size, const char* path);
+void list_close(Node** head);
 void list_insert(Node** head, uint16_t data);
 void list_insert_after(Node* prev_node, uint16_t data);
 void list_insert_before(Node** head, Node* next_node, uint16_t data);
@@ -0,0 +1,47 @@
+/*Petter Eriksson, 2024-10-04, git: Milloz-dev*, peer22@student.bth.se*/
+#ifndef MALLOC_TRACE_H
+#define MALLOC_TRACE_H
+
+#include <stdint.h>
+
+/*Allocation traces
+*
+*A trace file, as written by the cM2.c interposer, is a trace_header_t followed by fixed-size trace_record_t, one per
+*call. The records of one thread are in the order it made the calls; records of different threads are interleaved
+*in the order they were flushed. For a global order, take a record as giving up its block (ptr of free, arg of
+*realloc) at start and getting the block in ptr at timestamp: the block a thread gives up is stamped before it goes
+*back, the one it gets after it is its own, so another thread getting the same address is always stamped later.
+*Everything is in the byte order of the machine that recorded it.
+*/
+#define TRACE_MAGIC "MMTRACE2"  // Start of every trace file
+
+// What a record is about
+typedef enum {
+    TRACE_MALLOC,       // ptr = malloc(size)
+    TRACE_FREE,         // free(ptr)
+    TRACE_CALLOC,       // ptr = calloc(arg, size / arg), size is the total
+    TRACE_REALLOC,      // ptr = realloc(arg, size)
+    TRACE_MEMALIGN,     // ptr = memalign(arg, size)
+    TRACE_MMAP,         // ptr = mmap(..., size, ...)
+    TRACE_MUNMAP,       // munmap(ptr, size), arg is the result
+    TRACE_OPS
+} trace_op_t;
+
+typedef struct {
+    char magic[8];          // TRACE_MAGIC
+    uint32_t record_size;   // sizeof(trace_record_t)
+    uint32_t pid;           // Process that was traced
+    uint64_t start;         // CLOCK_MONOTONIC nanoseconds when tracing started
+} trace_header_t;
+
+typedef struct {
+    uint64_t timestamp;     // CLOCK_MONOTONIC nanoseconds when the call returned, for free when it was made
+    uint64_t start;         // CLOCK_MONOTONIC nanoseconds when the call was made (realloc, munmap), else timestamp
+    uint64_t ptr;           // Block returned, or the one freed or unmapped
+    uint64_t size;          // Bytes asked for
+    uint64_t arg;           // Per op, see trace_op_t, otherwise 0
+    uint32_t thread;        // Kernel id of the calling thread
+    uint32_t op;            // trace_op_t
+} trace_record_t;
+
+#endif // MALLOC_TRACE_H
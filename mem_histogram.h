@@ -0,0 +1,55 @@
+/*Petter Eriksson, 2024-10-04, git: Milloz-dev*, peer22@student.bth.se*/
+#ifndef MEM_HISTOGRAM_H
+#define MEM_HISTOGRAM_H
+
+#include <time.h>
+#include "memory_manager.h"
+
+/*Latency histograms
+*
+*The histograms of mem_profile, also kept by trace_replay and bench_memory_manager so their numbers compare:
+*MEM_PROFILE_BUCKETS buckets, four per power of two (HDR style), so any value is off by at most a quarter.
+*/
+
+// CLOCK_MONOTONIC nanoseconds
+static inline unsigned long long mem_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000000ULL + (unsigned long long)now.tv_nsec;
+}
+
+// Bucket of a value, the last bucket takes everything past it
+static inline int mem_histogram_bucket(unsigned long long value) {
+    if (value < 4) {
+        return (int)value;
+    }
+    int exponent = 63 - __builtin_clzll(value);
+    int bucket = (exponent - 1) * 4 + (int)((value >> (exponent - 2)) & 3);
+    return bucket < MEM_PROFILE_BUCKETS ? bucket : MEM_PROFILE_BUCKETS - 1;
+}
+
+// Smallest value of a bucket
+static inline unsigned long long mem_histogram_floor(int bucket) {
+    if (bucket < 4) {
+        return (unsigned long long)bucket;
+    }
+    return (4ULL + (unsigned long long)(bucket % 4)) << (bucket / 4 - 1);
+}
+
+// Smallest value of the bucket the given fraction of the counts reaches, 0 for an empty histogram
+static inline unsigned long long mem_histogram_percentile(const unsigned long long* histogram, double fraction) {
+    unsigned long long total = 0;
+    for (int i = 0; i < MEM_PROFILE_BUCKETS; i++) {
+        total += histogram[i];
+    }
+    unsigned long long seen = 0;
+    for (int i = 0; i < MEM_PROFILE_BUCKETS; i++) {
+        seen += histogram[i];
+        if (seen > 0 && (double)seen >= fraction * (double)total) {
+            return mem_histogram_floor(i);
+        }
+    }
+    return 0;
+}
+
+#endif // MEM_HISTOGRAM_H
@@ -1,156 +1,2522 @@
 /*Petter Eriksson, 2024-10-04, git: Milloz-dev*, peer22@student.bth.se*/
+#define _GNU_SOURCE  // For sched_getcpu
 #include "memory_manager.h"
+#include "mem_histogram.h"
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
 
-pthread_mutex_t memory_lock;
+pthread_mutex_t memory_lock = PTHREAD_MUTEX_INITIALIZER;  // Serializes mem_init and mem_deinit of the default pool
 
-static char* heap = NULL;        // Pointer to the actual memory pool (data)
-static struct Mblock* heap_header = NULL;  // Pointer to the first memory block's metadata
+#define MM_NUM_BINS 64  // One size class per power of two, enough for any size_t
+#define MM_GRANULE 16   // Blocks start and end on granules of this many bytes
+#define MM_POOL_ALIGN 4096  // The pool data starts on a page boundary
+#define MM_HUGE_PAGE (2 * 1024 * 1024)  // Huge page size, and the data alignment of pools that ask for huge pages
+#define MM_COMMIT_CHUNK (64 * 1024)     // An mmap-backed pool makes its pages accessible this many bytes at a time
+#define MM_MAX_CHUNKS 32    // Chunks a pool can grow by, each at least doubles it
+#define MM_FILE_MAGIC "MMPOOL1"  // Start of every pool file
 
-/*
-*Initializes the memory manager with a specified size of memory pool. The memory pool could be any data structure, for instance, 
-*a large array or a similar contuguous block of memory.
-*(You do not have to interact directly with the hardware or the operating system’s memory management functions).
+// Every block must be suitably aligned for any object, like memory from malloc
+_Static_assert(MM_GRANULE % _Alignof(max_align_t) == 0, "MM_GRANULE must be a multiple of the alignment of max_align_t");
+
+#define MM_CACHE_CLASSES 16  // Thread caches hold blocks of 16, 32, ..., 256 bytes
+#define MM_CACHE_LIMIT 32    // Most blocks one thread may hold per cached size
+#define MM_CACHE_FLUSH 16    // Blocks handed back to the pool at once when a cached size overflows
+#define MM_STATS_FLUSH 64    // Calls a thread counts before adding them to the pool's counters
+#define MM_CACHE_POOLS 4     // Pools a thread keeps a cache for at the same time
+
+#define MM_BLOCK_CACHED 2    // is_free value of a block parked in a thread cache or a shared free list
+
+#define MM_BLOCK_DEFERRED 3  // is_free value of a freed block waiting on a quick list to be merged
+#define MM_QUICK_CLASSES 64  // Quick lists hold freed blocks of 16, 32, ..., 1024 bytes
+
+#define MM_DEPOT_SLOT_MASK 0xffffffffULL  // Low half of a shared free list head: granule of the top block + 1
+
+/*Arena
+*
+*An independent part of a pool with its own lock, block list, free lists and header slab.
+*Arena i owns the bytes [i * arena_span, (i + 1) * arena_span) of the pool, so a pointer is routed back to its
+*arena by a division. Chunks a pool grows by are arenas of their own past those.
+*/
+typedef struct Arena {
+    pthread_mutex_t lock;                   // Protects everything below
+    struct mem_pool* pool;                  // Pool the arena belongs to
+    struct Mblock* heap_header;             // First block of the arena (address order)
+    size_t size;                            // Bytes of pool owned by the arena
+    struct Mblock* rover;                   // Where the next next-fit search starts
+    struct Mblock* header_slab;             // Block headers of this arena, carved out of the pool region
+    size_t slab_capacity;                   // Number of headers in the slab
+    size_t slab_used;                       // Headers handed out so far (the slab is used front to back)
+    struct Mblock* free_headers;            // Recycled headers, linked through next_free
+    struct Mblock* free_bins[MM_NUM_BINS];  // Segregated free lists, bin i holds free blocks of size [2^i, 2^(i+1))
+    unsigned long long bin_map;             // Bit i is set when free_bins[i] is non-empty
+    unsigned long long* free_map;           // Bitmap policy only: bit g is set when granule g of the arena is free
+    struct Mblock* quick[MM_QUICK_CLASSES]; // Freed blocks not merged yet, one list per size, linked through next_free
+    int quick_count;                        // Blocks on the quick lists
+} Arena;
+
+/*Block state
+*
+*is_free of a block is also changed by thread caches and the shared free lists, without the arena lock, so it is
+*always read and written atomically. Relaxed order is enough: a block changes hands through locks or the free lists,
+*and the locked path only needs to see a state that is not 1 for a block it must not merge.
+*/
+static inline int block_state(const Mblock* block) {
+    return __atomic_load_n(&block->is_free, __ATOMIC_RELAXED);
+}
+
+static inline void block_set_state(Mblock* block, int state) {
+    __atomic_store_n(&block->is_free, state, __ATOMIC_RELAXED);
+}
+
+// A depot_pop that lost its race may still read next_free of a block that has moved on, so it is written atomically too
+static inline void block_set_next_free(Mblock* block, Mblock* next) {
+    __atomic_store_n(&block->next_free, next, __ATOMIC_RELAXED);
+}
+
+/*Pool
+*
+*Everything a pool needs lives in one region from the system allocator: the pool data, the block index,
+*the header slabs, the arenas and this structure itself, so a pool is dropped with a single free.
+*A persistent pool is the same region mapped from a file, after a page holding the PoolFile header.
+*/
+struct mem_pool {
+    char* region;                       // The region from the system, as returned by calloc or mmap
+    size_t region_size;                 // Bytes mapped, for munmap
+    mem_pages_t pages;                  // Where the region came from
+    size_t data_size;                   // Bytes reserved for the pool data (heap_size rounded up to whole pages if mapped)
+    size_t committed;                   // Bytes from the start of the data that are accessible
+    size_t commit_chunk;                // Step in which the committed part grows
+    pthread_mutex_t commit_lock;        // Serializes growing the committed part
+    size_t trim_page;                   // Unit in which free pages are given back to the system
+    unsigned long long* trimmed;        // Bit p is set when page p of the data was given back and not used since
+    size_t trimmed_pages;               // Bits set in trimmed
+    char* heap;                         // Pointer to the actual memory pool (data), the first page boundary in the region
+    size_t heap_size;                   // Size of the pool in bytes (a whole number of granules), grows with it
+    size_t base_size;                   // Size the pool was created with
+    size_t max_size;                    // Size the pool may grow to
+    struct Mblock** block_index;        // One slot per granule: the header of the block starting there
+    struct Mblock* headers;             // Header slabs of all arenas, an arena at byte offset o of slot i starts at o / MM_GRANULE + 2 * i
+    unsigned long long* free_maps;      // Free granule bitmaps of all arenas (bitmap policy only), laid out like the headers
+    Arena* arenas;                      // The arenas
+    int arena_count;                    // Number of arenas in use, grows with the pool
+    int base_count;                     // Arenas the pool was created with, threads pick their home among these
+    int arena_slots;                    // Arenas there is room for
+    size_t arena_span;                  // Bytes of pool owned by each arena (the last one may own less)
+    size_t chunk_start[MM_MAX_CHUNKS];  // Offset of each grown chunk, chunk k is arena base_count + k
+    pthread_mutex_t grow_lock;          // Serializes adding and dropping chunks, and the slab list
+    struct PoolFile* file;              // Header of the file the pool is kept in, NULL if it is not persistent
+    void* root;                         // Entry point to the data of a persistent pool
+    ptrdiff_t moved;                    // How far a persistent pool was moved when it was opened, 0 if not at all
+    struct mem_slab* slabs;             // Slabs of a persistent pool, kept in the pool itself
+    unsigned long long allocs;          // Allocation calls, added to by the thread caches now and then
+    unsigned long long frees;           // Free calls, likewise
+    unsigned long long resizes;         // Resize calls, likewise
+    long long live_bytes;               // Bytes allocated and not freed, likewise
+    long long peak_bytes;               // Highest live_bytes seen
+    mem_arena_affinity_t affinity;      // How threads pick their home arena
+    mem_fit_policy_t fit;               // How a free block is picked for a request
+    mem_backend_t backend;              // How blocks are split and merged
+    int defer_limit;                    // Freed blocks an arena keeps unmerged, 0 merges every free at once
+    int quiet;                          // Report errors only through return values
+    unsigned int next_arena;            // Round-robin counter for threads picking a home arena
+    unsigned long id;                   // Unique for the life of the process, tells thread caches apart
+    int depot_enabled;                  // Whether every granule fits in the low half of a depot head
+    unsigned long long depot[MM_CACHE_CLASSES];  // Lock-free shared free lists of small blocks (tag << 32 | slot)
+    struct mem_pool* next;              // Next live pool
+};
+
+static mem_pool_t* default_pool = NULL;   // Pool behind mem_init/mem_alloc/mem_free/mem_resize/mem_deinit
+
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;  // Protects live_pools and keeps pools alive while caches drain
+static mem_pool_t* live_pools = NULL;     // All pools that have been created and not destroyed
+static unsigned long next_pool_id = 0;    // Last id handed to a pool
+
+/*Profiling
+*
+*Built with -DMM_PROFILE (make PROFILE=1), every thread records how long its alloc, free and resize calls take, how
+*many blocks each fit search visits, and how long it waits for and then holds arena locks. The histograms have four
+*buckets per power of two (HDR style), so any value is off by at most a quarter. A thread only ever writes its own
+*record and mem_profile adds them all up when asked; records of threads that exited are folded into one total.
+*Records are mapped straight from the system, so profiling works when this is the process's malloc too.
+*Without MM_PROFILE the hooks below compile to nothing.
+*/
+#ifdef MM_PROFILE
+typedef struct ThreadProfile {
+    mem_profile_t counts;                   // What the thread has recorded
+    unsigned long long held_since;          // When the thread took the arena lock it holds (at most one at a time)
+    unsigned long long visits;              // Blocks visited by the fit search under way
+    struct ThreadProfile* next;             // Next live thread
+} ThreadProfile;
+
+static pthread_mutex_t profiles_lock = PTHREAD_MUTEX_INITIALIZER;  // Protects profiles and profile_retired
+static ThreadProfile* profiles = NULL;      // Records of live threads
+static mem_profile_t profile_retired;       // Sum of the records of threads that exited
+static pthread_key_t profile_key;
+static pthread_once_t profile_key_once = PTHREAD_ONCE_INIT;
+static __thread ThreadProfile* thread_profile = NULL;
+
+// Add the counters of one record to another, reading each whole while its thread may be writing it
+static void profile_merge(mem_profile_t* into, mem_profile_t* from) {
+    unsigned long long* to = (unsigned long long*)into;
+    unsigned long long* counters = (unsigned long long*)from;
+    for (size_t i = 0; i < sizeof(mem_profile_t) / sizeof(unsigned long long); i++) {
+        to[i] += __atomic_load_n(&counters[i], __ATOMIC_RELAXED);
+    }
+}
+
+// Fold the record of an exiting thread into the total
+static void profile_thread_exit(void* record) {
+    ThreadProfile* profile = (ThreadProfile*)record;
+    pthread_mutex_lock(&profiles_lock);
+    for (ThreadProfile** link = &profiles; *link != NULL; link = &(*link)->next) {
+        if (*link == profile) {
+            *link = profile->next;
+            break;
+        }
+    }
+    profile_merge(&profile_retired, &profile->counts);
+    pthread_mutex_unlock(&profiles_lock);
+    thread_profile = NULL;  // Other exit handlers may still take arena locks, they get a fresh record
+    munmap(profile, sizeof(ThreadProfile));
+}
+
+static void profile_key_create(void) {
+    pthread_key_create(&profile_key, profile_thread_exit);
+}
+
+// Record of the calling thread, created on first use
+static ThreadProfile* profile_get(void) {
+    if (thread_profile == NULL) {
+        ThreadProfile* profile = (ThreadProfile*)mmap(NULL, sizeof(ThreadProfile), PROT_READ | PROT_WRITE,
+                                                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (profile == MAP_FAILED) {
+            abort();  // Nowhere to count, and no way to tell the caller
+        }
+        pthread_once(&profile_key_once, profile_key_create);
+        pthread_setspecific(profile_key, profile);
+        pthread_mutex_lock(&profiles_lock);
+        profile->next = profiles;
+        profiles = profile;
+        pthread_mutex_unlock(&profiles_lock);
+        thread_profile = profile;
+    }
+    return thread_profile;
+}
+
+// Only the owning thread writes a counter, so a plain load and store suffices, atomic so readers see whole values
+static void profile_add(unsigned long long* counter, unsigned long long amount) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + amount, __ATOMIC_RELAXED);
+}
+
+static void profile_latency(mem_op_t op, unsigned long long start) {
+    profile_add(&profile_get()->counts.latency[op][mem_histogram_bucket(mem_now_ns() - start)], 1);
+}
+
+// Close a fit search, recording how many blocks it visited
+static void profile_scanned(void) {
+    ThreadProfile* profile = profile_get();
+    profile_add(&profile->counts.scanned[mem_histogram_bucket(profile->visits)], 1);
+    profile->visits = 0;
+}
+
+#define PROFILE_START() unsigned long long profile_start = mem_now_ns()
+#define PROFILE_END(op) profile_latency(op, profile_start)
+#define PROFILE_VISIT() (profile_get()->visits++)
+#define PROFILE_SCANNED() profile_scanned()
+#else
+#define PROFILE_START()
+#define PROFILE_END(op)
+#define PROFILE_VISIT()
+#define PROFILE_SCANNED()
+#endif
+
+/*Arena locks
+*
+*Every arena lock is taken and released through these, so a profiling build can tell the time spent waiting for a lock
+*apart from the time it is held. An uncontended lock is taken with a trylock and costs no clock read to wait for.
+*/
+static void arena_lock(Arena* arena) {
+#ifdef MM_PROFILE
+    ThreadProfile* profile = profile_get();
+    if (pthread_mutex_trylock(&arena->lock) != 0) {
+        unsigned long long start = mem_now_ns();
+        pthread_mutex_lock(&arena->lock);
+        unsigned long long waited = mem_now_ns() - start;
+        profile_add(&profile->counts.lock_waits, 1);
+        profile_add(&profile->counts.lock_wait_ns, waited);
+        profile_add(&profile->counts.lock_wait[mem_histogram_bucket(waited)], 1);
+    }
+    profile_add(&profile->counts.lock_acquires, 1);
+    profile->held_since = mem_now_ns();
+#else
+    pthread_mutex_lock(&arena->lock);
+#endif
+}
+
+static void arena_unlock(Arena* arena) {
+#ifdef MM_PROFILE
+    ThreadProfile* profile = profile_get();
+    unsigned long long held = mem_now_ns() - profile->held_since;
+    profile_add(&profile->counts.lock_hold_ns, held);
+    profile_add(&profile->counts.lock_hold[mem_histogram_bucket(held)], 1);
+#endif
+    pthread_mutex_unlock(&arena->lock);
+}
+
+/*Size class helper
+*
+*Maps a block size to its bin, i.e. the index of the highest set bit (floor(log2(size))).
+*/
+static int size_class(size_t size) {
+    return 63 - __builtin_clzll((unsigned long long)size);
+}
+
+/*Free granule bitmap
+*
+*With the bitmap placement policy every arena also keeps one bit per granule, set while the granule is part of a
+*free block. A free block is exactly a run of set bits, so a fit is found by scanning whole words.
+*/
+static void map_update(Arena* arena, Mblock* block, int free) {
+    if (arena->free_map == NULL) {
+        return;
+    }
+    size_t first = (size_t)((char*)block->ptr - (char*)arena->heap_header->ptr) / MM_GRANULE;
+    size_t end = first + block->size / MM_GRANULE;
+    while (first < end) {
+        size_t bits = 64 - first % 64 < end - first ? 64 - first % 64 : end - first;
+        unsigned long long mask = (bits == 64 ? ~0ULL : ((1ULL << bits) - 1)) << (first % 64);
+        if (free) {
+            arena->free_map[first / 64] |= mask;
+        } else {
+            arena->free_map[first / 64] &= ~mask;
+        }
+        first += bits;
+    }
+}
+
+// First granule at or after from whose bit equals free, or granules if there is none
+static size_t map_scan(Arena* arena, size_t from, size_t granules, int free) {
+    while (from < granules) {
+        unsigned long long word = arena->free_map[from / 64];
+        if (!free) {
+            word = ~word;
+        }
+        word &= ~0ULL << (from % 64);
+        if (word != 0) {
+            size_t found = from - from % 64 + __builtin_ctzll(word);
+            return found < granules ? found : granules;
+        }
+        from = from - from % 64 + 64;
+    }
+    return granules;
+}
+
+// Push a free block on the front of its size class list
+static void bin_insert(Arena* arena, Mblock* block) {
+    map_update(arena, block, 1);
+    int bin = size_class(block->size);
+    block->prev_free = NULL;
+    block_set_next_free(block, arena->free_bins[bin]);
+    if (arena->free_bins[bin] != NULL) {
+        arena->free_bins[bin]->prev_free = block;
+    }
+    arena->free_bins[bin] = block;
+    arena->bin_map |= 1ULL << bin;
+}
+
+// Unlink a free block from its size class list
+static void bin_remove(Arena* arena, Mblock* block) {
+    map_update(arena, block, 0);
+    int bin = size_class(block->size);
+    if (block->prev_free != NULL) {
+        block_set_next_free(block->prev_free, block->next_free);
+    } else {
+        arena->free_bins[bin] = block->next_free;
+    }
+    if (block->next_free != NULL) {
+        block->next_free->prev_free = block->prev_free;
+    }
+    if (arena->free_bins[bin] == NULL) {
+        arena->bin_map &= ~(1ULL << bin);
+    }
+    block_set_next_free(block, NULL);
+    block->prev_free = NULL;
+}
+
+/*Header slab
+*
+*Headers are taken from the slab that the pool carves out next to its data, never from the system allocator.
+*Released headers are recycled first so that only the front of the slab is ever touched.
+*Returns NULL when the slab is exhausted.
+*/
+static Mblock* header_new(Arena* arena) {
+    Mblock* header = arena->free_headers;
+    if (header != NULL) {
+        arena->free_headers = header->next_free;
+    } else if (arena->slab_used < arena->slab_capacity) {
+        header = &arena->header_slab[arena->slab_used++];
+    }
+    return header;
+}
+
+// Give a header back to the slab
+static void header_release(Arena* arena, Mblock* header) {
+    block_set_state(header, 0);
+    block_set_next_free(header, arena->free_headers);
+    arena->free_headers = header;
+}
+
+// Round a request up to a whole number of granules
+static size_t granule_round(size_t size) {
+    return (size + MM_GRANULE - 1) & ~(size_t)(MM_GRANULE - 1);
+}
+
+// Bytes from ptr to the next multiple of alignment (a power of two)
+static size_t align_padding(void* ptr, size_t alignment) {
+    return (size_t)(-(uintptr_t)ptr & (alignment - 1));
+}
+
+/*Block index
+*
+*Every block starts on a granule boundary, so slot g of block_index holds the header of the block starting at
+*granule g (or NULL). The slot of an allocated block only changes when the block is freed, which lets its owner
+*look the header up without holding a lock.
+*/
+static void index_set(mem_pool_t* pool, void* ptr, Mblock* header) {
+    // Atomic, because the shared free lists read slots without a lock
+    __atomic_store_n(&pool->block_index[(size_t)((char*)ptr - pool->heap) / MM_GRANULE], header, __ATOMIC_RELAXED);
+}
+
+// Does ptr point into the pool's data?
+static int pool_owns(mem_pool_t* pool, void* ptr) {
+    return (char*)ptr >= pool->heap && (char*)ptr < pool->heap + __atomic_load_n(&pool->heap_size, __ATOMIC_ACQUIRE);
+}
+
+/*Header lookup
+*
+*Maps a user pointer to its block header in constant time through the block index.
+*Returns NULL for pointers outside the pool or not at the start of a block.
+*/
+static Mblock* find_header(mem_pool_t* pool, void* block) {
+    if (!pool_owns(pool, block)) {
+        return NULL;
+    }
+    size_t offset = (size_t)((char*)block - pool->heap);
+    if (offset % MM_GRANULE != 0) {
+        return NULL;
+    }
+    return __atomic_load_n(&pool->block_index[offset / MM_GRANULE], __ATOMIC_RELAXED);
+}
+
+// The arena owning a pointer inside the pool
+static Arena* arena_of(mem_pool_t* pool, void* block) {
+    size_t offset = (size_t)((char*)block - pool->heap);
+    if (offset < pool->base_size) {
+        return &pool->arenas[offset / pool->arena_span];
+    }
+    // A grown chunk, there are only a few of them
+    int i = __atomic_load_n(&pool->arena_count, __ATOMIC_ACQUIRE) - 1;
+    while (__atomic_load_n(&pool->chunk_start[i - pool->base_count], __ATOMIC_RELAXED) > offset) {
+        i--;
+    }
+    return &pool->arenas[i];
+}
+
+/*Segregated fit search
+*
+*Blocks in the request's own bin may still be too small, so that bin is scanned for the first fit.
+*Every block in a higher bin is large enough, so the first non-empty one is found with a single bit scan.
+*/
+static Mblock* find_segregated_fit(Arena* arena, size_t size) {
+    int bin = size_class(size);
+
+    for (Mblock* current = arena->free_bins[bin]; current != NULL; current = current->next_free) {
+        PROFILE_VISIT();
+        if (current->size >= size) {
+            return current;
+        }
+    }
+
+    if (bin + 1 >= MM_NUM_BINS) {
+        return NULL;
+    }
+    unsigned long long larger = arena->bin_map & (~0ULL << (bin + 1));
+    if (larger == 0) {
+        return NULL;
+    }
+    PROFILE_VISIT();
+    return arena->free_bins[__builtin_ctzll(larger)];
+}
+
+/*Best fit search
+*
+*The smallest block that fits is either in the request's own bin or, failing that, the smallest block of the first
+*non-empty higher bin, since every block there is larger than anything below it. Only those two bins are scanned.
+*/
+static Mblock* find_best_fit(Arena* arena, size_t size) {
+    int bin = size_class(size);
+    Mblock* best = NULL;
+
+    for (Mblock* current = arena->free_bins[bin]; current != NULL; current = current->next_free) {
+        PROFILE_VISIT();
+        if (current->size >= size && (best == NULL || current->size < best->size)) {
+            best = current;
+            if (best->size == size) {
+                return best;  // Exact fit, nothing can beat it
+            }
+        }
+    }
+    if (best != NULL || bin + 1 >= MM_NUM_BINS) {
+        return best;
+    }
+
+    unsigned long long larger = arena->bin_map & (~0ULL << (bin + 1));
+    if (larger == 0) {
+        return NULL;
+    }
+    for (Mblock* current = arena->free_bins[__builtin_ctzll(larger)]; current != NULL; current = current->next_free) {
+        PROFILE_VISIT();
+        if (best == NULL || current->size < best->size) {
+            best = current;
+        }
+    }
+    return best;
+}
+
+// Address-ordered first fit: the lowest free block that is large enough
+static Mblock* find_first_fit(Mblock* from, Mblock* to, size_t size) {
+    for (Mblock* current = from; current != to; current = current->next) {
+        PROFILE_VISIT();
+        if (block_state(current) == 1 && current->size >= size) {
+            return current;
+        }
+    }
+    return NULL;
+}
+
+// Next fit: first fit starting where the previous search left off, wrapping around once
+static Mblock* find_next_fit(Arena* arena, size_t size) {
+    Mblock* found = find_first_fit(arena->rover, NULL, size);
+    if (found == NULL) {
+        found = find_first_fit(arena->heap_header, arena->rover, size);
+    }
+    return found;
+}
+
+// Bitmap fit: the lowest run of free granules long enough, found a word at a time
+static Mblock* find_bitmap_fit(Arena* arena, size_t size) {
+    mem_pool_t* pool = arena->pool;
+    size_t base = (size_t)((char*)arena->heap_header->ptr - pool->heap) / MM_GRANULE;
+    size_t granules = arena->size / MM_GRANULE;
+    size_t needed = size / MM_GRANULE;
+
+    size_t start = map_scan(arena, 0, granules, 1);
+    while (start < granules) {
+        PROFILE_VISIT();  // A free run, the bitmap skips the allocated blocks between them
+        size_t end = map_scan(arena, start, granules, 0);
+        if (end - start >= needed) {
+            return pool->block_index[base + start];  // A run of free granules is exactly one free block
+        }
+        start = map_scan(arena, end, granules, 1);
+    }
+    return NULL;
+}
+
+// Pick a free block for a request according to the pool's placement policy
+static Mblock* find_free_block(Arena* arena, size_t size) {
+    switch (arena->pool->fit) {
+    case MEM_FIT_BEST:
+        return find_best_fit(arena, size);
+    case MEM_FIT_FIRST:
+        return find_first_fit(arena->heap_header, NULL, size);
+    case MEM_FIT_NEXT:
+        return find_next_fit(arena, size);
+    case MEM_FIT_BITMAP:
+        return find_bitmap_fit(arena, size);
+    default:
+        return find_segregated_fit(arena, size);
+    }
+}
+
+/*Buddy backend
+*
+*With MEM_BACKEND_BUDDY every block is a power of two of at least MM_GRANULE bytes, at an offset from the start of its
+*arena that is a multiple of its size. The buddy of a block is found by flipping the bit of its size in that offset
+*(offset ^ size), so splitting and merging take O(log n). Each bin holds free blocks of exactly one size.
+*The address-ordered next/prev links are not used.
+*/
+static size_t buddy_round(size_t size) {
+    size_t rounded = MM_GRANULE;
+    while (rounded < size) {
+        if (rounded > ((size_t)-1 >> 1)) {
+            return 0;  // No power of two that large
+        }
+        rounded <<= 1;
+    }
+    return rounded;
+}
+
+// Round a request up to the size of the block that will hold it, 0 if no block can
+static size_t block_round(mem_pool_t* pool, size_t size) {
+    if (pool->backend == MEM_BACKEND_BUDDY) {
+        return buddy_round(size);
+    }
+    return granule_round(size);
+}
+
+// The block starting offset bytes into an arena, NULL if no block starts there
+static Mblock* buddy_at(Arena* arena, size_t offset) {
+    return find_header(arena->pool, (char*)arena->heap_header->ptr + offset);
+}
+
+// Offset of a block from the start of its arena
+static size_t buddy_offset(Arena* arena, Mblock* block) {
+    return (size_t)((char*)block->ptr - (char*)arena->heap_header->ptr);
+}
+
+// Cover a new arena with free blocks, the largest power of two that fits first
+static void buddy_carve(Arena* arena) {
+    size_t offset = 0;
+    while (offset < arena->size) {
+        size_t size = MM_GRANULE;
+        while (size * 2 <= arena->size - offset) {
+            size *= 2;
+        }
+        Mblock* block = offset == 0 ? arena->heap_header : header_new(arena);
+        block->ptr = (char*)arena->heap_header->ptr + offset;
+        block->size = size;
+        block_set_state(block, 1);
+        block->next = NULL;
+        block->prev = NULL;
+        index_set(arena->pool, block->ptr, block);
+        bin_insert(arena, block);
+        offset += size;
+    }
+}
+
+// Halve a block until it is size bytes, freeing the upper halves. Their buddies are the block itself, so they cannot merge.
+static void buddy_split(Arena* arena, Mblock* block, size_t size) {
+    while (block->size > size) {
+        block->size /= 2;
+        Mblock* upper = header_new(arena);
+        upper->ptr = (char*)block->ptr + block->size;
+        upper->size = block->size;
+        block_set_state(upper, 1);
+        upper->next = NULL;
+        upper->prev = NULL;
+        index_set(arena->pool, upper->ptr, upper);
+        bin_insert(arena, upper);
+    }
+}
+
+// Free a block and merge it with its buddy for as long as the buddy is free and whole
+static void buddy_release(Arena* arena, Mblock* block) {
+    block_set_state(block, 1);
+    for (;;) {
+        size_t offset = buddy_offset(arena, block);
+        size_t buddy_off = offset ^ block->size;
+        if (buddy_off + block->size > arena->size) {
+            break;  // The buddy would lie past the end of the arena
+        }
+        Mblock* buddy = buddy_at(arena, buddy_off);
+        if (buddy == NULL || block_state(buddy) != 1 || buddy->size != block->size) {
+            break;
+        }
+        bin_remove(arena, buddy);
+        Mblock* lower = buddy_off < offset ? buddy : block;
+        Mblock* upper = buddy_off < offset ? block : buddy;
+        index_set(arena->pool, upper->ptr, NULL);
+        header_release(arena, upper);
+        lower->size *= 2;
+        block_set_state(lower, 1);
+        block = lower;
+    }
+    bin_insert(arena, block);
+}
+
+// Take a block of size bytes (a power of two) aligned to alignment, splitting the smallest free block that fits
+static Mblock* buddy_alloc(Arena* arena, size_t size, size_t alignment) {
+    // A block is aligned to its own size within the arena, so take one at least as large as the alignment
+    size_t search = alignment > size ? alignment : size;
+    if (size == 0 || search > arena->size) {
+        return NULL;
+    }
+    unsigned long long fits = arena->bin_map & (~0ULL << size_class(search));
+    if (fits == 0) {
+        return NULL;
+    }
+    Mblock* block = arena->free_bins[__builtin_ctzll(fits)];
+    bin_remove(arena, block);
+    buddy_split(arena, block, size);
+    block_set_state(block, 0);
+
+    // Arenas are only page aligned, so larger alignments may still miss
+    if (align_padding(block->ptr, alignment) != 0) {
+        buddy_release(arena, block);
+        return NULL;
+    }
+    return block;
+}
+
+// Double an allocated block in place until it is size bytes, if each buddy on the way up is free and whole
+static int buddy_grow(Arena* arena, Mblock* block, size_t size) {
+    size_t offset = buddy_offset(arena, block);
+    for (size_t order = block->size; order < size; order *= 2) {
+        Mblock* buddy = buddy_at(arena, offset + order);
+        if ((offset & order) != 0 || offset + 2 * order > arena->size ||
+            buddy == NULL || block_state(buddy) != 1 || buddy->size != order) {
+            return 0;  // The block is the upper half at this order, or its buddy is taken
+        }
+    }
+    while (block->size < size) {
+        Mblock* buddy = buddy_at(arena, offset + block->size);
+        bin_remove(arena, buddy);
+        index_set(arena->pool, buddy->ptr, NULL);
+        header_release(arena, buddy);
+        block->size *= 2;
+    }
+    return 1;
+}
+
+/*Front split
+*
+*Splits the first pad bytes off a block taken out of the free lists. The leading piece stays free and goes back into
+*its size class, the rest is returned. Used to align a block without wasting a whole block per request.
+*/
+static Mblock* split_front(Arena* arena, Mblock* block, size_t pad) {
+    Mblock* rest = header_new(arena);
+    rest->ptr = (char*)block->ptr + pad;
+    rest->size = block->size - pad;
+    block_set_state(rest, 0);
+    rest->next = block->next;
+    rest->prev = block;
+    if (block->next != NULL) {
+        block->next->prev = rest;
+    }
+    block->size = pad;
+    block->next = rest;
+    block_set_state(block, 1);
+    index_set(arena->pool, rest->ptr, rest);
+    bin_insert(arena, block);
+    return rest;
+}
+
+/*Locked allocation
+*
+*Takes a block of exactly size bytes (a whole number of granules) starting on a multiple of alignment out of the arena's
+*free lists, splitting off the rest. Blocks always start on a granule, so alignments up to MM_GRANULE cost nothing extra.
+*Must be called with the arena lock held. Returns NULL if no block fits.
+*/
+static Mblock* alloc_block(Arena* arena, size_t size, size_t alignment) {
+    if (arena->pool->backend == MEM_BACKEND_BUDDY) {
+        return buddy_alloc(arena, size, alignment);
+    }
+
+    // Room for the worst-case padding, so any block found can be aligned
+    if (alignment > MM_GRANULE && size > (size_t)-1 - (alignment - MM_GRANULE)) {
+        return NULL;  // Would wrap around to a small request
+    }
+    size_t padded = alignment > MM_GRANULE ? size + alignment - MM_GRANULE : size;
+
+    // Placement policy picks the block, segregated fit by default
+    Mblock* current = find_free_block(arena, padded);
+    PROFILE_SCANNED();
+    if (current == NULL) {
+        return NULL;
+    }
+
+    bin_remove(arena, current);
+
+    // Give the bytes in front of the aligned address back as a free block of their own
+    size_t pad = alignment > MM_GRANULE ? align_padding(current->ptr, alignment) : 0;
+    if (pad > 0) {
+        current = split_front(arena, current, pad);
+    }
+
+    // Check if the current block can be split into a smaller block
+    if (current->size > size) {
+        // Take a header for the remaining memory from the slab, one exists for every granule
+        Mblock* new_block = header_new(arena);
+
+        // Initialize the new block with the remaining memory details
+        new_block->ptr = (char *)current->ptr + size;  // New block starts after the allocated block
+        new_block->size = current->size - size;  // Remaining size
+        block_set_state(new_block, 1);  // New block is free
+        new_block->next = current->next;  // Link it to the next block
+        new_block->prev = current;
+        if (current->next != NULL) {
+            current->next->prev = new_block;
+        }
+
+        // Update the properties of the current block to reflect the allocation
+        current->size = size;   // Set size to requested size
+        current->next = new_block;  // Link new block after the current one
+        index_set(arena->pool, new_block->ptr, new_block);
+
+        // The remainder goes back into the free list of its own size class
+        bin_insert(arena, new_block);
+    }
+
+    // Mark the block as not free (allocated)
+    block_set_state(current, 0);
+
+    // Next fit continues after the block just handed out
+    arena->rover = current->next != NULL ? current->next : arena->heap_header;
+    return current;
+}
+
+/*Locked deallocation
+*
+*Marks an allocated block as free and coalesces it with free neighbours.
+*Must be called with the lock of the block's arena held.
+*/
+static void release_block(Arena* arena, Mblock* current) {
+    if (arena->pool->backend == MEM_BACKEND_BUDDY) {
+        buddy_release(arena, current);
+        return;
+    }
+
+    block_set_state(current, 1); // Mark current block as free
+
+    // Check if the next block is free and can be coalesced(ihopsatt)
+    if (current->next != NULL && block_state(current->next) == 1) {
+        struct Mblock* next = current->next; // Next block
+        bin_remove(arena, next);
+        index_set(arena->pool, next->ptr, NULL);
+        current->next = next->next; // Bypass the next block
+        if (next->next != NULL) {
+            next->next->prev = current;
+        }
+        current->size += next->size; // Increase size by the size of the next block
+        if (arena->rover == next) {
+            arena->rover = current;
+        }
+        header_release(arena, next);
+    }
+
+    // Check if the previous block is free and can be coalesced(ihopsatt)
+    struct Mblock* previous = current->prev;
+    if (previous != NULL && block_state(previous) == 1) {
+        bin_remove(arena, previous);
+        index_set(arena->pool, current->ptr, NULL);
+        previous->next = current->next;// Bypass the next block
+        if (current->next != NULL) {
+            current->next->prev = previous;
+        }
+        previous->size += current->size;// Increase size by the size of the previous block
+        if (arena->rover == current) {
+            arena->rover = previous;
+        }
+        header_release(arena, current);
+        current = previous;
+    }
+
+    // File the (possibly merged) block under its new size class
+    bin_insert(arena, current);
+}
+
+/*In-place shrink
+*
+*Cuts an allocated block down to size bytes (a whole number of granules) and frees the tail, which coalesces with a
+*free block after it. Must be called with the arena lock held.
+*/
+static void shrink_block(Arena* arena, Mblock* block, size_t size) {
+    if (block->size <= size) {
+        return;
+    }
+    if (arena->pool->backend == MEM_BACKEND_BUDDY) {
+        buddy_split(arena, block, size);
+        return;
+    }
+    Mblock* tail = header_new(arena);
+    tail->ptr = (char*)block->ptr + size;
+    tail->size = block->size - size;
+    block_set_state(tail, 0);
+    tail->next = block->next;
+    tail->prev = block;
+    if (block->next != NULL) {
+        block->next->prev = tail;
+    }
+    block->size = size;
+    block->next = tail;
+    index_set(arena->pool, tail->ptr, tail);
+    release_block(arena, tail);
+}
+
+/*In-place growth
+*
+*Absorbs the free block right after an allocated block if together they hold size bytes.
+*Returns 0 and changes nothing otherwise. The caller gives back any excess with shrink_block.
+*Must be called with the arena lock held.
+*/
+static int grow_block(Arena* arena, Mblock* block, size_t size) {
+    if (arena->pool->backend == MEM_BACKEND_BUDDY) {
+        return buddy_grow(arena, block, size);
+    }
+    Mblock* next = block->next;
+    if (next == NULL || block_state(next) != 1 || block->size + next->size < size) {
+        return 0;
+    }
+    bin_remove(arena, next);
+    index_set(arena->pool, next->ptr, NULL);
+    block->next = next->next;
+    if (next->next != NULL) {
+        next->next->prev = block;
+    }
+    block->size += next->size;
+    if (arena->rover == next) {
+        arena->rover = block;
+    }
+    header_release(arena, next);
+    return 1;
+}
+
+/*Trimmed pages
+*
+*mem_pool_trim gives the whole pages inside free blocks back to the system and marks them in the trimmed bitmap, so
+*a later trim skips them. Handing any part of a page out again clears its bit. Pages of different arenas can share
+*a bitmap word, hence the atomics.
+*/
+static void trim_forget(mem_pool_t* pool, size_t start, size_t end) {
+    if (__atomic_load_n(&pool->trimmed_pages, __ATOMIC_RELAXED) == 0) {
+        return;
+    }
+    for (size_t page = start / pool->trim_page; page * pool->trim_page < end; page++) {
+        unsigned long long* word = &pool->trimmed[page / 64];
+        if (__atomic_load_n(word, __ATOMIC_RELAXED) == 0) {
+            page |= 63;  // Nothing trimmed in this word
+            continue;
+        }
+        unsigned long long bit = 1ULL << (page % 64);
+        if (__atomic_fetch_and(word, ~bit, __ATOMIC_RELAXED) & bit) {
+            __atomic_fetch_sub(&pool->trimmed_pages, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// Give the whole pages inside a free block back to the system. Must be called with the arena lock held.
+static size_t trim_block(mem_pool_t* pool, Mblock* block) {
+    int advice = pool->file != NULL ? MADV_REMOVE : MADV_DONTNEED;  // Shared file pages are only freed from the file
+    size_t start = (size_t)((char*)block->ptr - pool->heap);
+    size_t end = start + block->size;
+    size_t committed = __atomic_load_n(&pool->committed, __ATOMIC_ACQUIRE);
+    if (end > committed) {
+        end = committed;  // Never touched past there
+    }
+
+    size_t released = 0;
+    size_t first = (start + pool->trim_page - 1) / pool->trim_page;
+    size_t last = end / pool->trim_page;
+    for (size_t page = first; page < last; page++) {
+        // Gather a run of pages that are not trimmed yet
+        size_t run = page;
+        while (run < last && !(__atomic_load_n(&pool->trimmed[run / 64], __ATOMIC_RELAXED) & (1ULL << (run % 64)))) {
+            run++;
+        }
+        if (run > page && madvise(pool->heap + page * pool->trim_page, (run - page) * pool->trim_page, advice) == 0) {
+            for (size_t p = page; p < run; p++) {
+                __atomic_fetch_or(&pool->trimmed[p / 64], 1ULL << (p % 64), __ATOMIC_RELAXED);
+            }
+            __atomic_fetch_add(&pool->trimmed_pages, run - page, __ATOMIC_RELAXED);
+            released += (run - page) * pool->trim_page;
+        }
+        page = run;
+    }
+    return released;
+}
+
+/*Lazy commit
+*
+*An mmap-backed pool reserves its data without access and makes it accessible in steps of commit_chunk as the highest
+*allocated byte grows, so creating a pool costs the same whatever its size. Free blocks never touch their data (the
+*headers live apart), so only allocated blocks need committed pages. The pages of [start_ptr, end_ptr) are also
+*no longer counted as trimmed. Returns 0 if the pages could not be committed.
+*/
+static int pool_commit(mem_pool_t* pool, void* start_ptr, void* end_ptr) {
+    size_t end = (size_t)((char*)end_ptr - pool->heap);
+    trim_forget(pool, (size_t)((char*)start_ptr - pool->heap), end);
+    if (end <= __atomic_load_n(&pool->committed, __ATOMIC_ACQUIRE)) {
+        return 1;
+    }
+
+    pthread_mutex_lock(&pool->commit_lock);
+    int committed = 1;
+    if (end > pool->committed) {
+        size_t target = (end + pool->commit_chunk - 1) / pool->commit_chunk * pool->commit_chunk;
+        if (target > pool->data_size) {
+            target = pool->data_size;
+        }
+        committed = mprotect(pool->heap + pool->committed, target - pool->committed, PROT_READ | PROT_WRITE) == 0;
+        if (committed) {
+            __atomic_store_n(&pool->committed, target, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&pool->commit_lock);
+    return committed;
+}
+
+// Make sure a freshly allocated block is accessible, giving it back if it cannot be. Must be called with the arena lock held.
+static Mblock* commit_block(Arena* arena, Mblock* block) {
+    if (block != NULL && !pool_commit(arena->pool, block->ptr, (char*)block->ptr + block->size)) {
+        release_block(arena, block);
+        return NULL;
+    }
+    return block;
+}
+
+/*Deferred coalescing
+*
+*With a defer limit set, freed blocks of up to MM_QUICK_CLASSES granules are kept unmerged on per-size quick lists
+*of their arena and handed out again as they are. They are merged in one pass when the arena runs out of space or
+*holds more than the limit, so churn of one size stops splitting and merging the same region over and over.
+*Blocks on a quick list are marked MM_BLOCK_DEFERRED, which keeps neighbours from merging with them.
+*/
+static int quick_class(Arena* arena, size_t size) {
+    if (arena->pool->defer_limit <= 0 || size > MM_QUICK_CLASSES * MM_GRANULE) {
+        return -1;
+    }
+    return (int)(size / MM_GRANULE) - 1;
+}
+
+// Merge every block on the quick lists. Must be called with the arena lock held.
+static int quick_flush(Arena* arena) {
+    int flushed = arena->quick_count;
+    for (int class = 0; class < MM_QUICK_CLASSES && arena->quick_count > 0; class++) {
+        while (arena->quick[class] != NULL) {
+            Mblock* block = arena->quick[class];
+            arena->quick[class] = block->next_free;
+            block_set_next_free(block, NULL);
+            block_set_state(block, 0);
+            arena->quick_count--;
+            release_block(arena, block);
+        }
+    }
+    return flushed;
+}
+
+// Allocate from an arena, reusing a deferred block of the exact size first. Must be called with the arena lock held.
+static Mblock* arena_alloc(Arena* arena, size_t size, size_t alignment) {
+    int class = quick_class(arena, size);
+    if (class >= 0 && alignment <= MM_GRANULE && arena->quick[class] != NULL) {
+        Mblock* block = arena->quick[class];
+        arena->quick[class] = block->next_free;
+        block_set_next_free(block, NULL);
+        block_set_state(block, 0);
+        arena->quick_count--;
+        return block;
+    }
+
+    Mblock* block = alloc_block(arena, size, alignment);
+    if (block == NULL && quick_flush(arena) > 0) {
+        block = alloc_block(arena, size, alignment);
+    }
+    return commit_block(arena, block);
+}
+
+// Free a block back to its arena, deferring the merge when possible. Must be called with the arena lock held.
+static void arena_free(Arena* arena, Mblock* block) {
+    int class = quick_class(arena, block->size);
+    if (class < 0) {
+        release_block(arena, block);
+        return;
+    }
+    if (arena->quick_count >= arena->pool->defer_limit) {
+        quick_flush(arena);
+    }
+    block_set_state(block, MM_BLOCK_DEFERRED);
+    block_set_next_free(block, arena->quick[class]);
+    arena->quick[class] = block;
+    arena->quick_count++;
+}
+
+// Allocate from one arena, taking and releasing its lock
+static Mblock* alloc_from(Arena* arena, size_t size, size_t alignment) {
+    arena_lock(arena);
+    Mblock* block = arena_alloc(arena, size, alignment);
+    arena_unlock(arena);
+    return block;
+}
+
+/*Locked lookup
+*
+*Locks the arena owning block and returns it, storing the block's header in *header.
+*Returns NULL (with no lock held) if block does not point into the pool. The header may still be NULL
+*for pointers that do not start a block.
+*/
+static Arena* lock_owner(mem_pool_t* pool, void* block, Mblock** header) {
+    *header = NULL;
+    if (pool == NULL || !pool_owns(pool, block)) {
+        return NULL;
+    }
+    Arena* arena = arena_of(pool, block);
+    arena_lock(arena);
+    *header = find_header(pool, block);
+    return arena;
+}
+
+/*Thread caches
+*
+*Each thread keeps a small stack of recently freed blocks per cached size, so that most alloc/free pairs of small
+*blocks are served without taking an arena lock. Blocks in a cache stay allocated as far as the arenas are concerned
+*and are marked MM_BLOCK_CACHED so double frees are still caught. A cache that overflows pushes MM_CACHE_FLUSH
+*blocks onto the pool's shared free lists, where other threads pick them up without locking, and the whole cache is
+*drained back to the arenas when its thread exits.
+*
+*A thread keeps one cache for each of the last MM_CACHE_POOLS pools it used. The cache also remembers the
+*thread's home arena in that pool.
+*/
+typedef struct ThreadCache {
+    mem_pool_t* pool;                                    // Pool the cached blocks belong to, NULL if unused
+    unsigned long pool_id;                               // Id of that pool, in case its address is reused
+    int home;                                            // Home arena of the thread in that pool
+    int count[MM_CACHE_CLASSES];                         // Blocks held per cached size
+    Mblock* blocks[MM_CACHE_CLASSES][MM_CACHE_LIMIT];    // Cached block headers, used as stacks
+    unsigned long allocs, frees, resizes;                // Calls not yet added to the pool's counters
+    long long bytes;                                     // Change in allocated bytes not yet added to the pool
+    long long bytes_high;                                // Highest bytes reached since then
+    int pending;                                         // Counted calls since then
+} ThreadCache;
+
+static __thread ThreadCache thread_caches[MM_CACHE_POOLS];
+static __thread int thread_cache_victim = 0;   // Next cache to reuse when all are taken
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+
+// Cached size slot of a rounded block size, or -1 if blocks of that size are not cached
+static int cache_class(size_t size) {
+    return size <= MM_CACHE_CLASSES * MM_GRANULE ? (int)(size / MM_GRANULE) - 1 : -1;
+}
+
+// Hand count blocks from the top of one cached size back to their arenas, locking each arena once per run
+static void cache_release(ThreadCache* cache, int class, int count) {
+    Arena* locked = NULL;
+    while (count-- > 0 && cache->count[class] > 0) {
+        Mblock* header = cache->blocks[class][--cache->count[class]];
+        Arena* arena = arena_of(cache->pool, header->ptr);
+        if (arena != locked) {
+            if (locked != NULL) {
+                arena_unlock(locked);
+            }
+            arena_lock(arena);
+            locked = arena;
+        }
+        block_set_state(header, 0);
+        arena_free(arena, header);
+    }
+    if (locked != NULL) {
+        arena_unlock(locked);
+    }
+}
+
+/*Shared free lists
+*
+*Each pool keeps a lock-free stack (Treiber stack) of parked small blocks per cached size, shared by all threads.
+*The head packs the granule of the top block (plus one, zero for empty) with a tag that every push and pop bumps,
+*so a compare-and-swap against a head that was popped and pushed again in the meantime fails (no ABA).
+*The link to the next block lives in the header's next_free field, which a parked block does not otherwise use.
+*Headers are never returned to the system while the pool lives, so reading a stale one is harmless.
+*/
+static unsigned long long depot_slot(mem_pool_t* pool, Mblock* block) {
+    return block == NULL ? 0 : (unsigned long long)((char*)block->ptr - pool->heap) / MM_GRANULE + 1;
+}
+
+// The header of the block a head points to, NULL for an empty stack or a block that has since been merged away
+static Mblock* depot_top(mem_pool_t* pool, unsigned long long head) {
+    unsigned long long slot = head & MM_DEPOT_SLOT_MASK;
+    return slot == 0 ? NULL : __atomic_load_n(&pool->block_index[slot - 1], __ATOMIC_RELAXED);
+}
+
+// Push a parked block onto the shared free list of its size
+static void depot_push(mem_pool_t* pool, int class, Mblock* block) {
+    unsigned long long head = __atomic_load_n(&pool->depot[class], __ATOMIC_RELAXED);
+    unsigned long long new_head;
+    do {
+        block_set_next_free(block, depot_top(pool, head));
+        new_head = ((head >> 32) + 1) << 32 | depot_slot(pool, block);
+    } while (!__atomic_compare_exchange_n(&pool->depot[class], &head, new_head, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// Pop a parked block from a shared free list, or NULL if it is empty
+static Mblock* depot_pop(mem_pool_t* pool, int class) {
+    unsigned long long head = __atomic_load_n(&pool->depot[class], __ATOMIC_ACQUIRE);
+    while ((head & MM_DEPOT_SLOT_MASK) != 0) {
+        Mblock* top = depot_top(pool, head);
+        if (top == NULL) {
+            // Popped and merged away since the head was read, the head has moved on
+            head = __atomic_load_n(&pool->depot[class], __ATOMIC_ACQUIRE);
+            continue;
+        }
+        Mblock* next = __atomic_load_n(&top->next_free, __ATOMIC_RELAXED);
+        unsigned long long new_head = ((head >> 32) + 1) << 32 | depot_slot(pool, next);
+        if (__atomic_compare_exchange_n(&pool->depot[class], &head, new_head, 1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+            return top;
+        }
+    }
+    return NULL;
+}
+
+// Hand every block on the shared free lists back to its arena. Returns the number of blocks handed back.
+static int depot_drain(mem_pool_t* pool) {
+    int drained = 0;
+    for (int class = 0; class < MM_CACHE_CLASSES && pool->depot_enabled; class++) {
+        Mblock* header;
+        while ((header = depot_pop(pool, class)) != NULL) {
+            Arena* arena = arena_of(pool, header->ptr);
+            arena_lock(arena);
+            block_set_state(header, 0);
+            arena_free(arena, header);
+            arena_unlock(arena);
+            drained++;
+        }
+    }
+    return drained;
+}
+
+// Number of blocks held in a cache
+static int cache_held(ThreadCache* cache) {
+    int held = 0;
+    for (int class = 0; class < MM_CACHE_CLASSES; class++) {
+        held += cache->count[class];
+    }
+    return held;
+}
+
+// Is the pool a cache refers to still alive? Must be called with pools_lock held.
+static int cache_pool_alive(ThreadCache* cache) {
+    for (mem_pool_t* pool = live_pools; pool != NULL; pool = pool->next) {
+        if (pool == cache->pool && pool->id == cache->pool_id) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*Statistics counters
+*
+*Every thread counts its calls on a pool in its cache and adds them to the pool's counters with relaxed atomics once
+*every MM_STATS_FLUSH calls, or when the cache is drained, so counting adds no contention. The highest point of the
+*thread's own change in allocated bytes is kept as well, so a peak between two flushes is not missed.
+*/
+static void stats_flush(ThreadCache* cache) {
+    mem_pool_t* pool = cache->pool;
+    __atomic_fetch_add(&pool->allocs, cache->allocs, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&pool->frees, cache->frees, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&pool->resizes, cache->resizes, __ATOMIC_RELAXED);
+    long long high = __atomic_fetch_add(&pool->live_bytes, cache->bytes, __ATOMIC_RELAXED) + cache->bytes_high;
+    long long peak = __atomic_load_n(&pool->peak_bytes, __ATOMIC_RELAXED);
+    while (high > peak && !__atomic_compare_exchange_n(&pool->peak_bytes, &peak, high, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    cache->allocs = cache->frees = cache->resizes = 0;
+    cache->bytes = cache->bytes_high = 0;
+    cache->pending = 0;
+}
+
+// Count a call of the calling thread on the cache's pool
+static void stats_count(ThreadCache* cache, unsigned long allocs, unsigned long frees, unsigned long resizes, long long bytes) {
+    cache->allocs += allocs;
+    cache->frees += frees;
+    cache->resizes += resizes;
+    cache->bytes += bytes;
+    if (cache->bytes > cache->bytes_high) {
+        cache->bytes_high = cache->bytes;
+    }
+    if (++cache->pending >= MM_STATS_FLUSH) {
+        stats_flush(cache);
+    }
+}
+
+// Hand every cached block and count back to its pool. Those of a destroyed pool are simply forgotten.
+static void cache_drain(ThreadCache* cache) {
+    if (cache_held(cache) == 0 && cache->pending == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&pools_lock);
+    if (cache_pool_alive(cache)) {
+        for (int class = 0; class < MM_CACHE_CLASSES; class++) {
+            cache_release(cache, class, cache->count[class]);
+        }
+        stats_flush(cache);
+    }
+    memset(cache->count, 0, sizeof(cache->count));
+    cache->allocs = cache->frees = cache->resizes = 0;
+    cache->bytes = cache->bytes_high = 0;
+    cache->pending = 0;
+    pthread_mutex_unlock(&pools_lock);
+}
+
+// Thread exit hook, so blocks are not stranded in the caches of a finished thread
+static void cache_thread_exit(void* caches) {
+    for (int i = 0; i < MM_CACHE_POOLS; i++) {
+        cache_drain(&((ThreadCache*)caches)[i]);
+    }
+}
+
+static void cache_key_create(void) {
+    pthread_key_create(&cache_key, cache_thread_exit);
+}
+
+// The calling thread's cache for a pool, taking over the least recently claimed one if needed
+static ThreadCache* cache_get(mem_pool_t* pool) {
+    for (int i = 0; i < MM_CACHE_POOLS; i++) {
+        if (thread_caches[i].pool == pool && thread_caches[i].pool_id == pool->id) {
+            return &thread_caches[i];
+        }
+    }
+
+    pthread_once(&cache_key_once, cache_key_create);
+    pthread_setspecific(cache_key, thread_caches);
+
+    ThreadCache* cache = &thread_caches[thread_cache_victim];
+    thread_cache_victim = (thread_cache_victim + 1) % MM_CACHE_POOLS;
+    cache_drain(cache);
+
+    cache->pool = pool;
+    cache->pool_id = pool->id;
+    if (pool->affinity == MEM_ARENA_ROUND_ROBIN) {
+        cache->home = (int)(__atomic_fetch_add(&pool->next_arena, 1, __ATOMIC_RELAXED) % (unsigned int)pool->base_count);
+    } else {
+        cache->home = 0;
+    }
+    return cache;
+}
+
+// Take a cached block of the given rounded size, falling back to the shared free lists, or NULL on a miss
+static void* cache_alloc(ThreadCache* cache, size_t size) {
+    int class = cache_class(size);
+    if (class < 0) {
+        return NULL;
+    }
+    Mblock* header;
+    if (cache->count[class] > 0) {
+        header = cache->blocks[class][--cache->count[class]];
+    } else if (cache->pool->depot_enabled && (header = depot_pop(cache->pool, class)) != NULL) {
+        // Taken from another thread's overflow without locking
+    } else {
+        return NULL;
+    }
+    block_set_state(header, 0);
+    return header->ptr;
+}
+
+// Park a freed block in the cache. Returns 0 if the block must go through the locked path instead.
+static int cache_free(mem_pool_t* pool, void* block) {
+    // The header of an allocated block is stable, so the owner may read it without the lock
+    Mblock* header = find_header(pool, block);
+    if (header == NULL || block_state(header) != 0) {
+        return 0;  // Let the locked path report invalid and double frees
+    }
+    int class = cache_class(header->size);
+    if (class < 0) {
+        return 0;
+    }
+
+    ThreadCache* cache = cache_get(pool);
+    stats_count(cache, 0, 1, 0, -(long long)header->size);
+    if (cache->count[class] == MM_CACHE_LIMIT) {
+        // Overflow: share the top part of this size with other threads, or return it to the arenas in one batch
+        if (pool->depot_enabled) {
+            for (int i = 0; i < MM_CACHE_FLUSH; i++) {
+                depot_push(pool, class, cache->blocks[class][--cache->count[class]]);
+            }
+        } else {
+            cache_release(cache, class, MM_CACHE_FLUSH);
+        }
+    }
+    block_set_state(header, MM_BLOCK_CACHED);
+    cache->blocks[class][cache->count[class]++] = header;
+    return 1;
+}
+
+/*Home arena
+*
+*Threads are spread over the arenas either round-robin, in the order they first use the pool,
+*or by the CPU they are currently running on.
+*/
+static int home_arena(mem_pool_t* pool, ThreadCache* cache) {
+    if (pool->base_count == 1) {
+        return 0;
+    }
+    if (pool->affinity == MEM_ARENA_BY_CPU) {
+        int cpu = sched_getcpu();
+        return cpu < 0 ? 0 : cpu % pool->base_count;
+    }
+    return cache->home;
+}
+
+// Allocate from the calling thread's home arena, falling back to the other arenas in turn
+static Mblock* alloc_any(mem_pool_t* pool, ThreadCache* cache, size_t size, size_t alignment) {
+    int home = home_arena(pool, cache);
+    int count = __atomic_load_n(&pool->arena_count, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < count; i++) {
+        Mblock* block = alloc_from(&pool->arenas[(home + i) % count], size, alignment);
+        if (block != NULL) {
+            return block;
+        }
+    }
+    return NULL;
+}
+
+/*Arena setup
+*
+*Sets up arena slot i to own size bytes starting offset bytes into the pool, as one free block (a few with the buddy
+*backend). Its headers and free granule bits are taken from the pool's at the same offset, so arenas laid out in
+*address order never overlap whatever their sizes. The arena lock is initialized by the caller.
+*/
+static void arena_init(mem_pool_t* pool, int i, size_t offset, size_t size) {
+    Arena* arena = &pool->arenas[i];
+    arena->pool = pool;
+    arena->size = size;
+    arena->header_slab = pool->headers + offset / MM_GRANULE + 2 * (size_t)i;
+    arena->slab_capacity = size / MM_GRANULE + 2;
+    arena->slab_used = 0;
+    arena->free_headers = NULL;
+    memset(arena->free_bins, 0, sizeof(arena->free_bins));
+    arena->bin_map = 0;
+    memset(arena->quick, 0, sizeof(arena->quick));
+    arena->quick_count = 0;
+    if (pool->free_maps != NULL) {
+        arena->free_map = pool->free_maps + offset / MM_GRANULE / 64 + (size_t)i;
+    }
+
+    // Take the header for the initial block from the slab
+    arena->heap_header = header_new(arena);
+
+    // Set the initial block header (outside the pool data)
+    arena->heap_header->ptr = pool->heap + offset;  // Set pointer to the start of the arena
+    arena->heap_header->size = size;               // Full size available for allocation
+    block_set_state(arena->heap_header, 1);
+    arena->heap_header->next = NULL;
+    arena->heap_header->prev = NULL;
+    index_set(pool, arena->heap_header->ptr, arena->heap_header);
+    arena->rover = arena->heap_header;
+
+    if (pool->backend == MEM_BACKEND_BUDDY) {
+        // Buddy blocks are powers of two, so the arena starts out as a few of them
+        buddy_carve(arena);
+        return;
+    }
+
+    // The whole arena starts out as one free block in its size class
+    bin_insert(arena, arena->heap_header);
+}
+
+/*Pool growth
+*
+*A pool created with a max_size above its size grows when an allocation finds no room. A chunk at least as large as
+*the pool so far, and as the request, is added past the end of the data as an arena of its own, so the pool at least
+*doubles each time and blocks never move. The region is reserved for max_size up front, and untouched pages cost no
+*memory. Returns 1 if the pool has grown since the caller saw seen arenas, 0 if it cannot grow any more.
+*/
+static int pool_grow(mem_pool_t* pool, size_t size, int seen) {
+    pthread_mutex_lock(&pool->grow_lock);
+    int count = pool->arena_count;
+    int grown = count != seen;  // Another thread got there first
+    if (!grown && count < pool->arena_slots) {
+        size_t offset = pool->heap_size;
+        size_t chunk = offset > size ? offset : size;
+        if (chunk > pool->max_size - offset) {
+            chunk = pool->max_size - offset;
+        }
+        if (chunk >= size && chunk > 0) {
+            Arena* arena = &pool->arenas[count];
+            arena_lock(arena);
+            arena_init(pool, count, offset, chunk);
+            arena_unlock(arena);
+            __atomic_store_n(&pool->chunk_start[count - pool->base_count], offset, __ATOMIC_RELAXED);
+            __atomic_store_n(&pool->heap_size, offset + chunk, __ATOMIC_RELEASE);
+            __atomic_store_n(&pool->arena_count, count + 1, __ATOMIC_RELEASE);
+            grown = 1;
+        }
+    }
+    pthread_mutex_unlock(&pool->grow_lock);
+    return grown;
+}
+
+// Take a completely free chunk out of use, returns 0 if some of it is in use. Must be called with its lock held.
+static int arena_retire(Arena* arena) {
+    quick_flush(arena);
+    size_t free_bytes = 0;
+    for (int bin = 0; bin < MM_NUM_BINS; bin++) {
+        for (Mblock* block = arena->free_bins[bin]; block != NULL; block = block->next_free) {
+            free_bytes += block->size;
+        }
+    }
+    if (free_bytes != arena->size) {
+        return 0;
+    }
+
+    // Threads that still see the arena find nothing to allocate in it
+    for (int bin = 0; bin < MM_NUM_BINS; bin++) {
+        while (arena->free_bins[bin] != NULL) {
+            Mblock* block = arena->free_bins[bin];
+            bin_remove(arena, block);
+            index_set(arena->pool, block->ptr, NULL);
+            block_set_state(block, 0);
+        }
+    }
+    arena->size = 0;
+    return 1;
+}
+
+/*Region mapping
+*
+*Gets a zeroed region of *size bytes from the system, with room to align its start to a page (or a huge page).
+*MEM_PAGES_HEAP uses calloc, the others an anonymous mapping. When explicit huge pages are not available it falls back
+*to transparent huge pages and updates *pages, saying so unless quiet is set. The size actually obtained is stored back
+*in *size.
+*/
+static char* pool_map(size_t* size, mem_pages_t* pages, size_t page, int quiet) {
+    if (*pages == MEM_PAGES_HEAP) {
+        *size += page;
+        return (char*)calloc(1, *size);
+    }
+
+    void* region = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (*pages == MEM_PAGES_HUGETLB) {
+        size_t huge_size = (*size + MM_HUGE_PAGE - 1) / MM_HUGE_PAGE * MM_HUGE_PAGE;
+        region = mmap(NULL, huge_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (region != MAP_FAILED) {
+            *size = huge_size;
+            return (char*)region;
+        }
+    }
+#endif
+    if (*pages == MEM_PAGES_HUGETLB) {
+        if (!quiet) {
+            printf("Warning: Huge pages are not available, using transparent huge pages.\n");
+        }
+        *pages = MEM_PAGES_HUGE;
+    }
+
+    *size += *pages == MEM_PAGES_HUGE ? MM_HUGE_PAGE : page;
+    region = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return region == MAP_FAILED ? NULL : (char*)region;
+}
+
+/*Fork handlers
+*
+*A child of fork has only the thread that forked, so a lock another thread held at that moment would stay taken
+*forever. Every lock of every pool is taken around fork instead, grow locks before arena locks before commit locks
+*as everywhere else, and let go on both sides.
+*/
+static void pools_fork_prepare(void) {
+    pthread_mutex_lock(&pools_lock);
+    for (mem_pool_t* pool = live_pools; pool != NULL; pool = pool->next) {
+        pthread_mutex_lock(&pool->grow_lock);
+        for (int i = 0; i < pool->arena_slots; i++) {
+            pthread_mutex_lock(&pool->arenas[i].lock);
+        }
+        pthread_mutex_lock(&pool->commit_lock);
+    }
+}
+
+static void pools_fork_release(void) {
+    for (mem_pool_t* pool = live_pools; pool != NULL; pool = pool->next) {
+        pthread_mutex_unlock(&pool->commit_lock);
+        for (int i = pool->arena_slots - 1; i >= 0; i--) {
+            pthread_mutex_unlock(&pool->arenas[i].lock);
+        }
+        pthread_mutex_unlock(&pool->grow_lock);
+    }
+    pthread_mutex_unlock(&pools_lock);
+}
+
+static pthread_once_t fork_handlers_once = PTHREAD_ONCE_INIT;
+
+static void fork_handlers_register(void) {
+    pthread_atfork(pools_fork_prepare, pools_fork_release, pools_fork_release);
+}
+
+// Register a pool so thread caches can tell it is alive
+static void pool_register(mem_pool_t* pool) {
+    pthread_once(&fork_handlers_once, fork_handlers_register);
+    pthread_mutex_lock(&pools_lock);
+    pool->id = ++next_pool_id;
+    pool->next = live_pools;
+    live_pools = pool;
+    pthread_mutex_unlock(&pools_lock);
+}
+
+/*Persistent pools
+*
+*A pool kept in a file holds plain pointers like any other: in its headers, free lists, slabs and the pool structure.
+*The file records the address it was last mapped at, which is wherever the system put it, so every file has its own.
+*Reopening maps it back there when that is free, a single mmap with nothing to rebuild. When something else holds
+*the address, the file is mapped elsewhere and pool_relocate moves every pointer of the pool by the difference;
+*pointers the program keeps in its blocks are its own to move (see mem_pool_moved). Only the locks and the
+*registration with the thread caches belong to a process, they are set up again on every open.
+*/
+typedef struct PoolFile {
+    char magic[8];          // MM_FILE_MAGIC
+    void* base;             // Address the file was last mapped at, where the pointers in it lead
+    size_t size;            // Bytes in the file
+    size_t layout;          // sizeof(mem_pool_t) of the code that wrote the file
+    size_t pool_offset;     // Offset of the pool structure from the pool data
+    int open;               // Set while a process has the file mapped
+} PoolFile;
+
+static void slabs_reopen(mem_pool_t* pool);
+static void slabs_relocate(mem_pool_t* pool, char* old_base, size_t size, char* new_base);
+
+// Map a pool file exactly at base, or anywhere the system likes if base is NULL. Returns NULL if that fails.
+static char* file_map(int fd, void* base, size_t size) {
+    int flags = MAP_SHARED;
+#ifdef MAP_FIXED_NOREPLACE
+    if (base != NULL) {
+        flags |= MAP_FIXED_NOREPLACE;
+    }
+#endif
+    void* region = mmap(base, size, PROT_READ | PROT_WRITE, flags, fd, 0);
+    if (region != MAP_FAILED && base != NULL && region != base) {
+        munmap(region, size);  // Taken as a hint, and something else is there
+        region = MAP_FAILED;
+    }
+    return region == MAP_FAILED ? NULL : (char*)region;
+}
+
+// Map a pool file anywhere at the same offset from a huge page boundary as base, so aligned blocks stay aligned
+static char* file_map_moved(int fd, void* base, size_t size) {
+    char* reserved = (char*)mmap(NULL, size + MM_HUGE_PAGE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (reserved == MAP_FAILED) {
+        return NULL;
+    }
+    size_t skip = ((uintptr_t)base % MM_HUGE_PAGE + MM_HUGE_PAGE - (uintptr_t)reserved % MM_HUGE_PAGE) % MM_HUGE_PAGE;
+    char* region = reserved + skip;
+    if (mmap(region, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(reserved, size + MM_HUGE_PAGE);
+        return NULL;
+    }
+    if (skip > 0) {
+        munmap(reserved, skip);
+    }
+    if (skip < MM_HUGE_PAGE) {
+        munmap(region + size, MM_HUGE_PAGE - skip);
+    }
+    return region;
+}
+
+// A pointer into the old mapping of a pool file, moved to the same place in the new one
+static void* file_rebase(void* ptr, char* old_base, size_t size, char* new_base) {
+    if ((char*)ptr < old_base || (char*)ptr > old_base + size) {
+        return ptr;  // NULL, or not into the file
+    }
+    return new_base + ((char*)ptr - old_base);
+}
+
+#define FILE_REBASE(field) ((field) = file_rebase((field), old_base, size, new_base))
+
+// Move every pointer of a pool whose file was mapped at old_base before and is at new_base now
+static void pool_relocate(mem_pool_t* pool, char* old_base, size_t size, char* new_base) {
+    FILE_REBASE(pool->region);
+    FILE_REBASE(pool->heap);
+    FILE_REBASE(pool->trimmed);
+    FILE_REBASE(pool->block_index);
+    FILE_REBASE(pool->headers);
+    FILE_REBASE(pool->free_maps);
+    FILE_REBASE(pool->arenas);
+    FILE_REBASE(pool->file);
+    FILE_REBASE(pool->root);
+    FILE_REBASE(pool->slabs);
+
+    for (int i = 0; i < pool->arena_slots; i++) {
+        Arena* arena = &pool->arenas[i];
+        FILE_REBASE(arena->pool);
+        FILE_REBASE(arena->heap_header);
+        FILE_REBASE(arena->rover);
+        FILE_REBASE(arena->header_slab);
+        FILE_REBASE(arena->free_headers);
+        FILE_REBASE(arena->free_map);
+        for (int bin = 0; bin < MM_NUM_BINS; bin++) {
+            FILE_REBASE(arena->free_bins[bin]);
+        }
+        for (int quick = 0; quick < MM_QUICK_CLASSES; quick++) {
+            FILE_REBASE(arena->quick[quick]);
+        }
+        // Every header the arena has handed out, in use, free or recycled
+        for (size_t h = 0; h < arena->slab_used; h++) {
+            Mblock* header = &arena->header_slab[h];
+            FILE_REBASE(header->ptr);
+            FILE_REBASE(header->next);
+            FILE_REBASE(header->prev);
+            FILE_REBASE(header->next_free);
+            FILE_REBASE(header->prev_free);
+        }
+    }
+    for (size_t slot = 0; slot <= pool->max_size / MM_GRANULE; slot++) {
+        if (pool->block_index[slot] != NULL) {
+            FILE_REBASE(pool->block_index[slot]);
+        }
+    }
+    slabs_relocate(pool, old_base, size, new_base);
+    pool->moved = new_base - old_base;
+}
+
+// Map an existing pool file back where it was and make it usable by this process. Returns NULL if it is not a pool.
+static mem_pool_t* pool_reopen(int fd, const char* path, size_t file_size, int quiet) {
+    PoolFile header;
+    if (pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+        memcmp(header.magic, MM_FILE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.size != file_size || header.layout != sizeof(mem_pool_t)) {
+        if (!quiet) {
+            printf("Error: %s is not a memory pool file.\n", path);
+        }
+        return NULL;
+    }
+    char* region = file_map(fd, header.base, header.size);
+    int moved = region == NULL;
+    if (moved) {
+        region = file_map_moved(fd, header.base, header.size);
+    }
+    if (region == NULL) {
+        if (!quiet) {
+            printf("Error: Cannot map %s.\n", path);
+        }
+        return NULL;
+    }
+
+    PoolFile* file = (PoolFile*)region;
+    mem_pool_t* pool = (mem_pool_t*)(region + MM_POOL_ALIGN + file->pool_offset);
+    pool->moved = 0;
+    if (moved) {
+        pool_relocate(pool, (char*)file->base, file->size, region);
+        file->base = region;
+    }
+    if (file->open) {
+        // Blocks that were on the shared free lists are lost, the rest is as the last process left it
+        if (!quiet) {
+            printf("Warning: %s was not closed cleanly.\n", path);
+        }
+        memset(pool->depot, 0, sizeof(pool->depot));
+    }
+    file->open = 1;
+
+    pool->quiet = quiet;
+    pthread_mutex_init(&pool->commit_lock, NULL);
+    pthread_mutex_init(&pool->grow_lock, NULL);
+    for (int i = 0; i < pool->arena_slots; i++) {
+        pthread_mutex_init(&pool->arenas[i].lock, NULL);
+    }
+    slabs_reopen(pool);
+    pool_register(pool);
+    return pool;
+}
+
+/*Pool creation
+*
+*Creates an independent pool of the given size. Returns NULL if the system is out of memory.
+*A NULL options pointer gives the defaults: a single arena, the list backend and segregated fit.
+*/
+mem_pool_t* mem_pool_create(size_t size) {
+    return mem_pool_create_with(size, NULL);
+}
+
+mem_pool_t* mem_pool_create_with(size_t size, const mem_options_t* options) {
+    int quiet = options != NULL && options->quiet;
+
+    // A persistent pool that already exists is taken as it is
+    int fd = -1;
+    if (options != NULL && options->file != NULL) {
+        fd = open(options->file, O_RDWR | O_CREAT, 0600);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            if (!quiet) {
+                printf("Error: Cannot open %s.\n", options->file);
+            }
+            if (fd >= 0) {
+                close(fd);
+            }
+            return NULL;
+        }
+        if (st.st_size > 0) {
+            mem_pool_t* pool = pool_reopen(fd, options->file, (size_t)st.st_size, quiet);
+            close(fd);
+            return pool;
+        }
+    }
+
+    // The pool is a whole number of granules
+    size = granule_round(size);
+
+    // Each arena owns a whole number of granules, and at least one
+    int count = (options != NULL && options->arenas > 1) ? options->arenas : 1;
+    mem_backend_t backend = options != NULL ? options->backend : MEM_BACKEND_LIST;
+    size_t span = granule_round((size + count - 1) / count);
+    if (span == 0) {
+        span = MM_GRANULE;
+    }
+    if (backend == MEM_BACKEND_BUDDY) {
+        span = buddy_round(span);  // Arenas start on a multiple of their size, so buddy blocks keep their alignment
+    }
+    while (count > 1 && (size_t)(count - 1) * span >= size) {
+        count--;
+    }
+
+    // A growable pool has room for its chunks, which are arenas of their own, up to max_size
+    size_t limit = options != NULL && options->max_size > size ? granule_round(options->max_size) : size;
+    int slots = limit > size ? count + MM_MAX_CHUNKS : count;
+
+    // Mapped pools keep their data on pages of its own, so it can be reserved and committed apart from the rest
+    mem_pages_t pages = options != NULL ? options->pages : MEM_PAGES_HEAP;
+    if (fd >= 0) {
+        pages = MEM_PAGES_MMAP;  // File pages are what they are
+    }
+    size_t page = pages == MEM_PAGES_HEAP ? sizeof(Mblock*) : pages == MEM_PAGES_MMAP ? MM_POOL_ALIGN : MM_HUGE_PAGE;
+    size_t data_size = (limit + page - 1) / page * page;
+
+    // One header per granule covers an arena split into blocks of MM_GRANULE bytes, plus its initial block
+    size_t index_slots = limit / MM_GRANULE + 1;
+    size_t slab_headers = limit / MM_GRANULE + 2 * (size_t)slots;
+    size_t index_offset = data_size;
+    size_t slab_offset = index_offset + index_slots * sizeof(Mblock*);
+    size_t arena_offset = granule_round(slab_offset + slab_headers * sizeof(Mblock));
+    size_t map_offset = granule_round(arena_offset + slots * sizeof(Arena));
+    size_t map_words = (options != NULL && options->fit == MEM_FIT_BITMAP) ? limit / MM_GRANULE / 64 + (size_t)slots : 0;
+    size_t trim_page = pages == MEM_PAGES_HEAP || pages == MEM_PAGES_MMAP ? MM_POOL_ALIGN : MM_HUGE_PAGE;
+    size_t trim_offset = granule_round(map_offset + map_words * sizeof(unsigned long long));
+    size_t trim_words = data_size / trim_page / 64 + 1;
+    size_t pool_offset = granule_round(trim_offset + trim_words * sizeof(unsigned long long));
+
+    // Allocate a large contiguous block of memory holding the pool, the block index, the header slabs,
+    // the arenas, the free granule bitmaps, the trimmed page bitmap and the pool structure. calloc and mmap leave
+    // large regions untouched until used, so unused headers cost no resident memory.
+    size_t region_size = pool_offset + sizeof(mem_pool_t);
+    char* region;
+    if (fd >= 0) {
+        // The file starts with a page for its header, then the pool data
+        region_size = MM_POOL_ALIGN + (region_size + MM_POOL_ALIGN - 1) / MM_POOL_ALIGN * MM_POOL_ALIGN;
+        region = ftruncate(fd, (off_t)region_size) == 0 ? file_map(fd, NULL, region_size) : NULL;
+        close(fd);
+        if (region == NULL) {
+            if (!quiet) {
+                printf("Error: Cannot map %s.\n", options->file);
+            }
+            return NULL;
+        }
+    } else {
+        region = pool_map(&region_size, &pages, MM_POOL_ALIGN, quiet);
+        if (region == NULL) {
+            return NULL;
+        }
+    }
+    // The pool data starts on a page boundary (a huge page if asked for), so the alignment of a block does not
+    // depend on where the region was put.
+    char* heap = fd >= 0 ? region + MM_POOL_ALIGN : region + align_padding(region, trim_page);
+
+    mem_pool_t* pool = (mem_pool_t*)(heap + pool_offset);
+    pool->region = region;
+    pool->region_size = region_size;
+    pool->heap = heap;
+    pool->pages = pages;
+    pool->data_size = data_size;
+    pool->committed = data_size;
+    pool->commit_chunk = pages == MEM_PAGES_HUGE ? MM_HUGE_PAGE : MM_COMMIT_CHUNK;
+    pthread_mutex_init(&pool->commit_lock, NULL);
+    pool->trim_page = trim_page;
+    pool->trimmed = (unsigned long long*)(heap + trim_offset);
+    if (fd < 0 && (pages == MEM_PAGES_MMAP || pages == MEM_PAGES_HUGE)) {
+        // Reserve the data without access, it is committed as the high-water mark grows
+        mprotect(heap, data_size, PROT_NONE);
+        pool->committed = 0;
+#ifdef MADV_HUGEPAGE
+        if (pages == MEM_PAGES_HUGE) {
+            madvise(heap, data_size, MADV_HUGEPAGE);
+        }
+#endif
+    }
+    pool->heap_size = size;
+    pool->base_size = size;
+    pool->max_size = limit;
+    pool->block_index = (Mblock**)(heap + index_offset);
+    pool->headers = (Mblock*)(heap + slab_offset);
+    pool->free_maps = map_words > 0 ? (unsigned long long*)(heap + map_offset) : NULL;
+    pool->arenas = (Arena*)(heap + arena_offset);
+    pool->arena_count = count;
+    pool->base_count = count;
+    pool->arena_slots = slots;
+    pool->arena_span = span;
+    pthread_mutex_init(&pool->grow_lock, NULL);
+    pool->affinity = options != NULL ? options->affinity : MEM_ARENA_ROUND_ROBIN;
+    pool->fit = options != NULL ? options->fit : MEM_FIT_SEGREGATED;
+    pool->backend = backend;
+    pool->defer_limit = options != NULL ? options->defer_limit : 0;
+    pool->quiet = quiet;
+    pool->depot_enabled = limit / MM_GRANULE < MM_DEPOT_SLOT_MASK;
+
+    for (int i = 0; i < slots; i++) {
+        pthread_mutex_init(&pool->arenas[i].lock, NULL);
+    }
+    for (int i = 0; i < count; i++) {
+        size_t start = (size_t)i * span;
+        arena_init(pool, i, start, (i == count - 1) ? size - start : span);
+    }
+
+    if (fd >= 0) {
+        pool->file = (PoolFile*)region;
+        memcpy(pool->file->magic, MM_FILE_MAGIC, sizeof(pool->file->magic));
+        pool->file->base = region;
+        pool->file->size = region_size;
+        pool->file->layout = sizeof(mem_pool_t);
+        pool->file->pool_offset = pool_offset;
+        pool->file->open = 1;
+    }
+
+    pool_register(pool);
+
+    return pool;
+}
+
+// Allocate size bytes (non-zero) aligned to alignment (a power of two) from the pool without reporting failure
+static void* pool_alloc(mem_pool_t* pool, size_t size, size_t alignment) {
+    size = block_round(pool, size);
+    if (size == 0) {
+        return NULL;  // Larger than any block can be
+    }
+
+    // Fast path: reuse a block this thread freed recently, those are only granule aligned
+    ThreadCache* cache = cache_get(pool);
+    int seen = __atomic_load_n(&pool->arena_count, __ATOMIC_ACQUIRE);
+    if (alignment <= MM_GRANULE) {
+        void* cached = cache_alloc(cache, size);
+        if (cached != NULL) {
+            stats_count(cache, 1, 0, 0, (long long)size);
+            return cached;
+        }
+    }
+
+    Mblock* current = alloc_any(pool, cache, size, alignment);
+
+    // Blocks parked in this thread's cache or the shared free lists may be what is missing, give them back and retry
+    if (current == NULL) {
+        int parked = cache_held(cache);
+        cache_drain(cache);
+        parked += depot_drain(pool);
+        if (parked > 0) {
+            current = alloc_any(pool, cache, size, alignment);
+        }
+    }
+
+    // Then grow the pool, leaving room to align the block
+    while (current == NULL && pool_grow(pool, size + (alignment > MM_GRANULE ? alignment : 0), seen)) {
+        seen = __atomic_load_n(&pool->arena_count, __ATOMIC_ACQUIRE);
+        current = alloc_any(pool, cache, size, alignment);
+    }
+
+    if (current == NULL) {
+        return NULL;
+    }
+    stats_count(cache, 1, 0, 0, (long long)current->size);
+    return current->ptr;
+}
+
+/*Pool allocation
+*
+*Allocates a block of at least size bytes from the pool. Returns NULL if no block fits.
+*Every block is aligned for any object type (max_align_t).
+*/
+void* mem_pool_alloc(mem_pool_t* pool, size_t size) {
+    return mem_pool_alloc_aligned(pool, size, MM_GRANULE);
+}
+
+/*Aligned pool allocation
+*
+*Allocates a block of at least size bytes starting on a multiple of alignment, which must be a power of two.
+*The padding in front of the block stays in the pool as a free block, so it is not lost.
+*/
+void* mem_pool_alloc_aligned(mem_pool_t* pool, size_t size, size_t alignment) {
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        if (!pool->quiet) {
+            printf("Error: Alignment %zu is not a power of two.\n", alignment);
+        }
+        return NULL;
+    }
+
+    // Zero-sized requests still get a unique block, like malloc(0)
+    if (size == 0) {
+        size = 1;
+    }
+
+    PROFILE_START();
+    void* block = pool_alloc(pool, size, alignment);
+    PROFILE_END(MEM_OP_ALLOC);
+
+    // If no suitable block is found
+    if (block == NULL) {
+        if (!pool->quiet) {
+            printf("Error: No suitable memory block for allocation of size %zu bytes.\n", size);
+        }
+        return NULL;
+    }
+
+    // Return a pointer to the allocated memory (data part)
+    return block;
+}
+
+static void pool_free(mem_pool_t* pool, void* block);
+static void* pool_resize(mem_pool_t* pool, void* block, size_t size);
+
+/*Pool deallocation
+*
+*Frees a block allocated from the pool. Pointers that are not the start of an allocated block are reported and ignored.
+*/
+void mem_pool_free(mem_pool_t* pool, void* block) {
+    PROFILE_START();
+    pool_free(pool, block);
+    PROFILE_END(MEM_OP_FREE);
+}
+
+static void pool_free(mem_pool_t* pool, void* block) {
+    // Check if the provided pointer is NULL, nothing to free
+    if (block == NULL) {
+        return;  // Return early since there's nothing to free
+    }
+
+    // Fast path: small blocks are parked in the thread cache
+    if (pool != NULL && cache_free(pool, block)) {
+        return;
+    }
+
+    // Look up the header of the block directly from its pointer, under the lock of the arena owning it
+    struct Mblock* current;
+    Arena* arena = lock_owner(pool, block, &current);
+    if (current == NULL) {
+        // Unlock mutex if no block where found to free
+        if (arena != NULL) {
+            arena_unlock(arena);
+        }
+        // If no block was found, print error message
+        if (pool == NULL || !pool->quiet) {
+            printf("Error: Freeing a block that was not allocated at %p.\n", block);
+        }
+        return;
+    }
+
+    // Check if block is already free
+    if (block_state(current)) {
+        if (!pool->quiet) {
+            printf("Warning: Attempt to free already free block at %p.\n", block);
+        }
+        arena_unlock(arena);
+        return;
+    }
+
+    size_t size = current->size;
+    arena_free(arena, current);
+
+    // Unlock mutex before exit
+    arena_unlock(arena);
+    stats_count(cache_get(pool), 0, 1, 0, -(long long)size);
+}
+
+/*Run carving
+*
+*Turns one allocated block of size * count bytes into count allocated blocks of size bytes, storing their
+*pointers in out. Must be called with the arena lock held.
+*/
+static void carve_run(Arena* arena, Mblock* run, size_t size, size_t count, void** out) {
+    Mblock* block = run;
+    out[0] = run->ptr;
+    for (size_t i = 1; i < count; i++) {
+        Mblock* piece = header_new(arena);
+        piece->ptr = (char*)block->ptr + size;
+        piece->size = block->size - size;
+        block_set_state(piece, 0);
+        piece->next = block->next;
+        piece->prev = block;
+        if (block->next != NULL) {
+            block->next->prev = piece;
+        }
+        block->size = size;
+        block->next = piece;
+        index_set(arena->pool, piece->ptr, piece);
+        out[i] = piece->ptr;
+        block = piece;
+    }
+}
+
+// Allocate up to count blocks of size bytes from one arena, as a single contiguous run if there is room.
+// Returns the number of blocks allocated. Must be called with the arena lock held.
+static size_t alloc_run(Arena* arena, size_t size, size_t count, void** out) {
+    if (arena->pool->backend == MEM_BACKEND_LIST && count > 1 && size <= (size_t)-1 / count) {
+        Mblock* run = commit_block(arena, alloc_block(arena, size * count, MM_GRANULE));
+        if (run != NULL) {
+            carve_run(arena, run, size, count, out);
+            return count;
+        }
+    }
+
+    size_t done = 0;
+    while (done < count) {
+        Mblock* block = arena_alloc(arena, size, MM_GRANULE);
+        if (block == NULL) {
+            break;
+        }
+        out[done++] = block->ptr;
+    }
+    return done;
+}
+
+// Order pointers by address for qsort
+static int compare_addresses(const void* a, const void* b) {
+    uintptr_t left = (uintptr_t)*(void* const*)a;
+    uintptr_t right = (uintptr_t)*(void* const*)b;
+    return left < right ? -1 : left > right;
+}
+
+// Frees count blocks without touching the statistics, returns how many were freed and their bytes in freed_bytes
+static size_t free_batch(mem_pool_t* pool, void** blocks, size_t count, size_t* freed_bytes) {
+    qsort(blocks, count, sizeof(void*), compare_addresses);
+
+    Arena* locked = NULL;
+    size_t freed = 0;
+    *freed_bytes = 0;
+    for (size_t i = 0; i < count; i++) {
+        void* block = blocks[i];
+        if (block == NULL) {
+            continue;
+        }
+        Mblock* header = NULL;
+        Arena* arena = pool_owns(pool, block) ? arena_of(pool, block) : NULL;
+        if (arena != NULL) {
+            if (arena != locked) {
+                if (locked != NULL) {
+                    arena_unlock(locked);
+                }
+                arena_lock(arena);
+                locked = arena;
+            }
+            header = find_header(pool, block);
+        }
+
+        if (header == NULL) {
+            if (!pool->quiet) {
+                printf("Error: Freeing a block that was not allocated at %p.\n", block);
+            }
+        } else if (block_state(header)) {
+            if (!pool->quiet) {
+                printf("Warning: Attempt to free already free block at %p.\n", block);
+            }
+        } else {
+            freed++;
+            *freed_bytes += header->size;
+            arena_free(arena, header);
+        }
+    }
+    if (locked != NULL) {
+        arena_unlock(locked);
+    }
+    return freed;
+}
+
+/*Batch deallocation
+*
+*Frees count blocks. The array is sorted by address in place, so each arena is locked once per run of its blocks
+*and neighbouring blocks coalesce in a single sweep. NULL entries are skipped, invalid ones reported as by mem_free.
 */
-void mem_init(size_t size) {
+void mem_pool_free_many(mem_pool_t* pool, void** blocks, size_t count) {
+    if (pool == NULL || blocks == NULL || count == 0) {
+        return;
+    }
 
-    pthread_mutex_init(&memory_lock, NULL);
+    size_t freed_bytes;
+    size_t freed = free_batch(pool, blocks, count, &freed_bytes);
+    stats_count(cache_get(pool), 0, freed, 0, -(long long)freed_bytes);
+}
 
-    // Allocate a large contiguous block of memory
-    heap = (char*)malloc(size);
-    if (heap == NULL) {
-        printf("Failed to initialize memory pool.\n");
-        exit(1);
+/*Batch allocation
+*
+*Allocates count blocks of at least size bytes each, storing their pointers in out. The home arena is locked once
+*for the whole batch, and the blocks are carved out of one contiguous run when a free block is large enough.
+*Returns count, or 0 with nothing allocated if the pool cannot hold them all.
+*/
+size_t mem_pool_alloc_many(mem_pool_t* pool, size_t size, size_t count, void** out) {
+    if (pool == NULL || out == NULL || count == 0) {
+        return 0;
     }
 
-    // Allocate memory for the metadata (header) separately
-    heap_header = (Mblock*)malloc(sizeof(Mblock));
-    if (heap_header == NULL) {
-        printf("Failed to initialize memory headers.\n");
-        free(heap);
-        exit(1);
+    // Zero-sized requests still get unique blocks, like malloc(0)
+    size_t block_size = block_round(pool, size == 0 ? 1 : size);
+    size_t done = 0;
+
+    ThreadCache* cache = cache_get(pool);
+    int seen = __atomic_load_n(&pool->arena_count, __ATOMIC_ACQUIRE);
+    for (int attempt = 0; attempt < 3 && block_size != 0 && done < count; attempt++) {
+        if (attempt == 1) {
+            // Blocks parked in this thread's cache or the shared free lists may be what is missing
+            cache_drain(cache);
+            depot_drain(pool);
+        } else if (attempt == 2 && !pool_grow(pool, block_size * (count - done), seen)) {
+            break;
+        }
+        int home = home_arena(pool, cache);
+        int arenas = __atomic_load_n(&pool->arena_count, __ATOMIC_ACQUIRE);
+        for (int i = 0; i < arenas && done < count; i++) {
+            Arena* arena = &pool->arenas[(home + i) % arenas];
+            arena_lock(arena);
+            done += alloc_run(arena, block_size, count - done, out + done);
+            arena_unlock(arena);
+        }
     }
 
-    // Set the initial block header (outside the pool)
-    heap_header->ptr = heap;    // Set pointer to the start of the memory pool
-    heap_header->size = size;   // Full size available for allocation
-    heap_header->is_free = 1;   
-    heap_header->next = NULL;
+    if (done < count) {
+        size_t ignored;
+        free_batch(pool, out, done, &ignored);  // Never counted as allocated, so not as freed either
+        if (!pool->quiet) {
+            printf("Error: No suitable memory block for allocation of %zu blocks of size %zu bytes.\n", count, size);
+        }
+        return 0;
+    }
+    stats_count(cache, count, 0, 0, (long long)(block_size * count));
+    return count;
 }
 
-/*Allocation function
+/*Pool resize
 *
-*Allocates a block of memory of the specified size. Find a suitable block in the pool, mark it as allocated,
-*and return the pointer to the start of the allocated block.
+*Changes the size of a block allocated from the pool. The block grows into a free block right after it and shrinks by
+*giving its tail back, both in place. It is only moved when it cannot grow where it is.
+*Everything up to the move happens in one critical section on the block's arena.
 */
-void* mem_alloc(size_t size) {
+void* mem_pool_resize(mem_pool_t* pool, void* block, size_t size) {
+    PROFILE_START();
+    void* resized = pool_resize(pool, block, size);
+    PROFILE_END(MEM_OP_RESIZE);
+    return resized;
+}
 
-    pthread_mutex_lock(&memory_lock);
+static void* pool_resize(mem_pool_t* pool, void* block, size_t size) {
+    // If the provided block is NULL, allocate a new block of the specified size
+    if (block == NULL) {
+        return mem_pool_alloc(pool, size);  // New allocation
+    }
 
-    // Start with the first block
-    Mblock* current = heap_header;
-
-    // First-fit allocation strategy: looks for the first suitable block 
-    while (current != NULL) {
-        // Check if the block is free and large enough
-        if (current->is_free && current->size >= size) {
-            // Mark the block as not free (allocated)
-            current->is_free = 0;
-            // Check if the current block can be split into a smaller block
-            if (current->size > size) {
-                // Allocate a new block structure for the remaining memory
-                Mblock* new_block = (Mblock*)malloc(sizeof(Mblock));  // Allocate memory for the new block metadata
-                if (new_block == NULL) {
-                    printf("Failed to allocate memory for new block header.\n");
-                    // Unlock before return Error
-                    pthread_mutex_unlock(&memory_lock);
-                    return NULL;
-                }
+    // Find the corresponding header for the block
+    Mblock* header;
+    Arena* arena = lock_owner(pool, block, &header);
 
-                // Initialize the new block with the remaining memory details
-                new_block->ptr = (char *)current->ptr + size;  // New block starts after the allocated block
-                new_block->size = current->size - size;  // Remaining size
-                new_block->is_free = 1;  // New block is free
-                new_block->next = current->next;  // Link it to the next block
+    // If the header is not found, leave the block alone
+    if (!header || block_state(header)) {
+        // Unlock mutex before return
+        if (arena != NULL) {
+            arena_unlock(arena);
+        }
+        return block;
+    }
 
-                // Update the properties of the current block to reflect the allocation
-                current->size = size;   // Set size to requested size
-                current->next = new_block;  // Link new block after the current one
-            }
-            // Unlock mutex before return
-            pthread_mutex_unlock(&memory_lock);
+    size_t new_size = block_round(pool, size == 0 ? 1 : size);
+    size_t old_size = header->size;
+    if (new_size == 0) {
+        arena_unlock(arena);
+        return NULL;  // Larger than any block can be, the old block is untouched
+    }
 
-           // Return a pointer to the allocated memory (data part)
-            return current->ptr;
+    // Grow or shrink where the block is
+    if (new_size <= old_size || grow_block(arena, header, new_size)) {
+        if (!pool_commit(pool, (char*)block + old_size, (char*)block + new_size)) {
+            shrink_block(arena, header, old_size);
+            arena_unlock(arena);
+            return NULL;  // No pages for the grown part, the old block is untouched
         }
+        shrink_block(arena, header, new_size);
+        size_t resized = header->size;
+        arena_unlock(arena);
+        stats_count(cache_get(pool), 0, 0, 1, (long long)resized - (long long)old_size);
+        return block;
+    }
 
-        // Move to the next block
-        current = current->next;
+    // Move within the same arena without letting go of the lock
+    Mblock* moved = arena_alloc(arena, new_size, MM_GRANULE);
+    if (moved != NULL) {
+        memcpy(moved->ptr, block, old_size);
+        arena_free(arena, header);
+        size_t resized = moved->size;
+        arena_unlock(arena);
+        stats_count(cache_get(pool), 0, 0, 1, (long long)resized - (long long)old_size);
+        return moved->ptr;
     }
+    arena_unlock(arena);
+    stats_count(cache_get(pool), 0, 0, 1, 0);  // The allocation and free below count the bytes
 
-    // If no suitable block is found
-    printf("Error: No suitable memory block for allocation of size %zu bytes.\n", size);
+    // The arena is full, try the rest of the pool. The old block is still ours, so its size cannot change meanwhile.
+    void* new_block = mem_pool_alloc(pool, size);
+    if (new_block == NULL) {
+        return NULL;  // Allocation failed, the old block is untouched
+    }
 
-    // Unlock mutex before return
-    pthread_mutex_unlock(&memory_lock);
-    return NULL;
+    // Copy the old data to the new block and free the old block
+    memcpy(new_block, block, old_size);
+    mem_pool_free(pool, block);
+
+    return new_block; // Return the pointer to the new block
 }
 
-/*Deallocation function
+/*Usable size
 *
-*Frees the specified block of memory. For allocation and deallocation, you need a way to track which parts of the memory pool
-* are free and which are allocated.
+*Bytes that may be used at block, at least what was asked for: the size of the block after rounding.
+*Returns 0 if block is not the start of an allocated block of the pool.
 */
-void mem_free(void* block) {
-    // Check if the provided pointer is NULL, nothing to free
-    if (block == NULL) {
-        return;  // Return early since there's nothing to free
+size_t mem_pool_usable_size(mem_pool_t* pool, void* block) {
+    Mblock* header;
+    Arena* arena = lock_owner(pool, block, &header);
+    if (arena == NULL) {
+        return 0;
     }
+    size_t size = header != NULL && block_state(header) == 0 ? header->size : 0;
+    arena_unlock(arena);
+    return size;
+}
 
-    pthread_mutex_lock(&memory_lock);
+/*Pool trim
+*
+*Gives the whole pages inside free blocks back to the system with madvise(MADV_DONTNEED), so the resident size of
+*the pool follows the bytes in use rather than its peak. The pages of a pool file would stay in the page cache and
+*the file that way, so they are punched out of the file with MADV_REMOVE instead; a file system that cannot do that
+*gives nothing back. Deferred blocks are merged first. The pages read as zero when they are used again. Chunks a pool has grown by are dropped, newest first, once completely free.
+*Returns the number of bytes given back by this call, pages trimmed earlier and not used since are not counted again.
+*/
+size_t mem_pool_trim(mem_pool_t* pool) {
+    size_t released = 0;
+    int first_bin = size_class(pool->trim_page);
+    pthread_mutex_lock(&pool->grow_lock);
+    for (int i = 0; i < pool->arena_count; i++) {
+        Arena* arena = &pool->arenas[i];
+        arena_lock(arena);
+        quick_flush(arena);
+        for (int bin = first_bin; bin < MM_NUM_BINS; bin++) {
+            for (Mblock* block = arena->free_bins[bin]; block != NULL; block = block->next_free) {
+                released += trim_block(pool, block);
+            }
+        }
+        arena_unlock(arena);
+    }
 
-    // Start searching from the beginning of the memory pool
-    struct Mblock* current = heap_header;
-    struct Mblock* previous = NULL;
+    // Their pages went back above, only the pool's size is left to shrink
+    while (pool->arena_count > pool->base_count) {
+        int last = pool->arena_count - 1;
+        Arena* arena = &pool->arenas[last];
+        arena_lock(arena);
+        int retired = arena_retire(arena);
+        arena_unlock(arena);
+        if (!retired) {
+            break;
+        }
+        __atomic_store_n(&pool->arena_count, last, __ATOMIC_RELEASE);
+        __atomic_store_n(&pool->heap_size, pool->chunk_start[last - pool->base_count], __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&pool->grow_lock);
+    return released;
+}
 
-    // Iterate through the memory blocks to find the one to free
-    while (current != NULL) {
-        // Check if this block corresponds to the provided pointer
-        if (current->ptr == block) {
-            // Check if block is already free
-            if (current->is_free) {
-                printf("Warning: Attempt to free already free block at %p.\n", block);
-                pthread_mutex_unlock(&memory_lock);
-                return;
+/*Pool statistics
+*
+*A snapshot of the pool. The block and byte figures are exact, taken arena by arena under their locks; blocks parked
+*in thread caches count as in use. The call counters and byte counts of other threads may lag by up to MM_STATS_FLUSH
+*calls each, those of the calling thread are complete.
+*/
+mem_stats_t mem_pool_stats(mem_pool_t* pool) {
+    mem_stats_t stats;
+    memset(&stats, 0, sizeof(stats));
+    for (int i = 0; i < MM_CACHE_POOLS; i++) {
+        if (thread_caches[i].pool == pool && thread_caches[i].pool_id == pool->id && thread_caches[i].pending > 0) {
+            stats_flush(&thread_caches[i]);
+        }
+    }
+
+    pthread_mutex_lock(&pool->grow_lock);  // Keeps chunks from coming and going meanwhile
+    stats.size = pool->heap_size;
+    size_t largest_sum = 0;  // Of the largest free block of each arena
+    for (int i = 0; i < pool->arena_count; i++) {
+        Arena* arena = &pool->arenas[i];
+        arena_lock(arena);
+        size_t free_blocks = 0;
+        size_t arena_largest = 0;
+        for (int bin = 0; bin < MM_NUM_BINS + MM_QUICK_CLASSES; bin++) {
+            // Deferred blocks are as free as any other
+            Mblock* block = bin < MM_NUM_BINS ? arena->free_bins[bin] : arena->quick[bin - MM_NUM_BINS];
+            for (; block != NULL; block = block->next_free) {
+                stats.free_bytes += block->size;
+                if (block->size > arena_largest) {
+                    arena_largest = block->size;
+                }
+                free_blocks++;
             }
+        }
+        largest_sum += arena_largest;
+        if (arena_largest > stats.largest_free) {
+            stats.largest_free = arena_largest;
+        }
 
-            current->is_free = 1; // Mark current block as free
+        // Every block has a header, free or not
+        size_t headers = arena->slab_used;
+        for (Mblock* header = arena->free_headers; header != NULL; header = header->next_free) {
+            headers--;
+        }
+        stats.free_blocks += free_blocks;
+        stats.used_blocks += headers - free_blocks;
+        arena_unlock(arena);
+    }
+    pthread_mutex_unlock(&pool->grow_lock);
 
-            // Check if the next block is free and can be coalesced(ihopsatt)
-            if (current->next != NULL && current->next->is_free == 1) {
-                struct Mblock* next = current->next; // Next block
-                current->next = next->next; // Bypass the next block
-                current->size += next->size; // Increase size by the size of the next block
-                free(next);
-            }
-            
-            // Check if the previous block is free and can be coalesced(ihopsatt)
-            if (previous != NULL && previous->is_free == 1) {
-                previous->next = current->next;// Bypass the next block
-                previous->size += current->size;// Increase size by the size of the previous block
-                free(current);
+    stats.used_bytes = stats.size - stats.free_bytes;
+    // Each arena's fragmentation weighted by its free bytes, as a request only ever needs one arena to fit
+    stats.fragmentation = stats.free_bytes > 0 ? 1.0 - (double)largest_sum / (double)stats.free_bytes : 0.0;
+    stats.trimmed_bytes = __atomic_load_n(&pool->trimmed_pages, __ATOMIC_RELAXED) * pool->trim_page;
+    stats.live_bytes = __atomic_load_n(&pool->live_bytes, __ATOMIC_RELAXED);
+    stats.peak_bytes = __atomic_load_n(&pool->peak_bytes, __ATOMIC_RELAXED);
+    stats.allocs = __atomic_load_n(&pool->allocs, __ATOMIC_RELAXED);
+    stats.frees = __atomic_load_n(&pool->frees, __ATOMIC_RELAXED);
+    stats.resizes = __atomic_load_n(&pool->resizes, __ATOMIC_RELAXED);
+    return stats;
+}
+
+/*Pool root
+*
+*A pool keeps one pointer for its user, the way back into the data of a persistent pool after it is reopened.
+*The root follows the pool when its file is mapped somewhere new, other pointers kept in blocks do not:
+*mem_pool_moved is what must be added to them, 0 when the file is where it was last time.
+*/
+void mem_pool_set_root(mem_pool_t* pool, void* root) {
+    pool->root = root;
+}
+
+void* mem_pool_root(mem_pool_t* pool) {
+    return pool->root;
+}
+
+ptrdiff_t mem_pool_moved(mem_pool_t* pool) {
+    return pool->moved;
+}
+
+/*Pool destruction
+*
+*Releases the whole pool at once, including every block still allocated from it.
+*Blocks parked in thread caches are forgotten the next time those threads look at them.
+*A persistent pool is written back to its file and unmapped instead, blocks and all. Blocks parked in the caches
+*of other threads stay allocated in the file, so those threads should be done with the pool by then.
+*/
+void mem_pool_destroy(mem_pool_t* pool) {
+    if (pool == NULL) {
+        return;
+    }
+
+    if (pool->file != NULL) {
+        // Blocks parked by this thread or on the shared free lists would be lost with the process
+        for (int i = 0; i < MM_CACHE_POOLS; i++) {
+            if (thread_caches[i].pool == pool && thread_caches[i].pool_id == pool->id) {
+                cache_drain(&thread_caches[i]);
             }
+        }
+        depot_drain(pool);
+    }
 
-            // Unlock mutex before exit
-            pthread_mutex_unlock(&memory_lock);
-            return;
+    // Unregister first, so no cache drain can touch the pool from now on
+    pthread_mutex_lock(&pools_lock);
+    for (mem_pool_t** link = &live_pools; *link != NULL; link = &(*link)->next) {
+        if (*link == pool) {
+            *link = pool->next;
+            break;
         }
-        previous = current;
-        current = current->next; // Move to the next block
     }
-    // Unlock mutex if no block where found to free
+    pthread_mutex_unlock(&pools_lock);
+
+    for (int i = 0; i < pool->arena_slots; i++) {
+        pthread_mutex_destroy(&pool->arenas[i].lock);
+    }
+    pthread_mutex_destroy(&pool->commit_lock);
+    pthread_mutex_destroy(&pool->grow_lock);
+
+    // Free the region, which holds the pool data, block index, headers, arenas and the pool itself
+    if (pool->file != NULL) {
+        // A persistent pool stays in its file, as it is
+        PoolFile* file = pool->file;
+        file->open = 0;
+        msync(file, file->size, MS_SYNC);
+        munmap(file, file->size);
+    } else if (pool->pages == MEM_PAGES_HEAP) {
+        free(pool->region);
+    } else {
+        munmap(pool->region, pool->region_size);
+    }
+}
+
+/*
+*Initializes the memory manager with a specified size of memory pool. The memory pool could be any data structure, for instance,
+*a large array or a similar contuguous block of memory.
+*(You do not have to interact directly with the hardware or the operating system’s memory management functions).
+*/
+void mem_init(size_t size) {
+    if (mem_init_with(size, NULL) != 0) {
+        exit(1);
+    }
+}
+
+/*Initialization with options
+*
+*Like mem_init, but the pool can be split into several arenas (see mem_options_t).
+*A pool left over from an earlier mem_init is released first.
+*Returns 0, or -1 with no pool if it cannot be created (a pool file that cannot be opened, or no memory).
+*/
+int mem_init_with(size_t size, const mem_options_t* options) {
+
+    pthread_mutex_lock(&memory_lock);
+
+    mem_pool_destroy(default_pool);
+    default_pool = mem_pool_create_with(size, options);
+    if (default_pool == NULL && (options == NULL || !options->quiet)) {
+        printf("Failed to initialize memory pool.\n");
+    }
+    int result = default_pool != NULL ? 0 : -1;
+
     pthread_mutex_unlock(&memory_lock);
-    // If no block was found, print error message
-    printf("Error: Freeing a block that was not allocated at %p.\n", block);
+    return result;
+}
+
+/*Allocation function
+*
+*Allocates a block of memory of the specified size. Find a suitable block in the pool, mark it as allocated,
+*and return the pointer to the start of the allocated block.
+*/
+void* mem_alloc(size_t size) {
+    return mem_pool_alloc(default_pool, size);
+}
+
+/*Aligned allocation function
+*
+*Allocates a block of memory of the specified size starting on a multiple of alignment (a power of two),
+*for example 64 for a cache line or 4096 for a page.
+*/
+void* mem_alloc_aligned(size_t size, size_t alignment) {
+    return mem_pool_alloc_aligned(default_pool, size, alignment);
+}
+
+/*Deallocation function
+*
+*Frees the specified block of memory. For allocation and deallocation, you need a way to track which parts of the memory pool
+* are free and which are allocated.
+*/
+void mem_free(void* block) {
+    mem_pool_free(default_pool, block);
+}
+
+/*Batch functions
+*
+*mem_alloc_many allocates count blocks of size bytes into out and returns count, or 0 if they do not all fit.
+*mem_free_many frees count blocks, sorting the array by address.
+*/
+size_t mem_alloc_many(size_t size, size_t count, void** out) {
+    return mem_pool_alloc_many(default_pool, size, count, out);
+}
+
+void mem_free_many(void** blocks, size_t count) {
+    mem_pool_free_many(default_pool, blocks, count);
 }
 
 /*Resize function
@@ -158,51 +2524,115 @@ void mem_free(void* block) {
 *Changes the size of the memory block, possibly moving it.
 */
 void* mem_resize(void* block, size_t size) {
-    // If the provided block is NULL, allocate a new block of the specified size
-    if (block == NULL) {
-        return mem_alloc(size);  // New allocation
-    }
+    return mem_pool_resize(default_pool, block, size);
+}
 
-    pthread_mutex_lock(&memory_lock);
+/*Trim function
+*
+*Gives the free pages of the pool back to the system and returns how many bytes that was.
+*/
+size_t mem_trim(void) {
+    return mem_pool_trim(default_pool);
+}
 
-    // Find the corresponding header for the block
-    Mblock* header = heap_header; // Start from the beginning
-    while (header) {
-        if (header->ptr == block) { // Compare with ptr directly
-            break;  // Found the corresponding header
-        }
-        header = header->next; // Move to next block header
-    }
+/*Usable size function
+*
+*Bytes that may be used at a block of the default pool, see mem_pool_usable_size.
+*/
+size_t mem_usable_size(void* block) {
+    return mem_pool_usable_size(default_pool, block);
+}
 
-    // If the header is not found or the current block is large enough, return the original block
-    if (!header || header->size >= size) {
-        // Unlock mutex before return
-        pthread_mutex_unlock(&memory_lock);
-        return block;
-    }
+/*Statistics function
+*
+*Returns a snapshot of the default pool, see mem_pool_stats.
+*/
+mem_stats_t mem_stats(void) {
+    return mem_pool_stats(default_pool);
+}
 
-    pthread_mutex_unlock(&memory_lock);
+/*Profile functions
+*
+*mem_profile fills in the profile of the whole process, every thread's record added up as it is read, and returns 1.
+*Threads that are still running may be a few calls further along by the time it returns. Without MM_PROFILE it
+*returns 0 and an empty profile. Bucket b of every histogram holds the values from mem_profile_bucket_floor(b) up to
+*the floor of the next one. mem_profile_reset starts over, mem_profile_dump prints percentiles of each histogram.
+*/
+int mem_profile(mem_profile_t* profile) {
+    memset(profile, 0, sizeof(mem_profile_t));
+#ifdef MM_PROFILE
+    pthread_mutex_lock(&profiles_lock);
+    profile_merge(profile, &profile_retired);
+    for (ThreadProfile* record = profiles; record != NULL; record = record->next) {
+        profile_merge(profile, &record->counts);
+    }
+    pthread_mutex_unlock(&profiles_lock);
+    return 1;
+#else
+    return 0;
+#endif
+}
 
-    // Allocate a new block of the requested size
-    void* new_block = mem_alloc(size);
+void mem_profile_reset(void) {
+#ifdef MM_PROFILE
+    pthread_mutex_lock(&profiles_lock);
+    memset(&profile_retired, 0, sizeof(mem_profile_t));
+    for (ThreadProfile* record = profiles; record != NULL; record = record->next) {
+        unsigned long long* counters = (unsigned long long*)&record->counts;
+        for (size_t i = 0; i < sizeof(mem_profile_t) / sizeof(unsigned long long); i++) {
+            __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&profiles_lock);
+#endif
+}
 
-    pthread_mutex_lock(&memory_lock);
+unsigned long long mem_profile_bucket_floor(int bucket) {
+    return mem_histogram_floor(bucket);
+}
 
-    if (new_block == NULL) {
-        pthread_mutex_unlock(&memory_lock);
-        return NULL;  // Allocation failed
+static void profile_print(FILE* out, const char* name, const unsigned long long* histogram) {
+    unsigned long long count = 0;
+    for (int i = 0; i < MEM_PROFILE_BUCKETS; i++) {
+        count += histogram[i];
     }
+    fprintf(out, "%-10s %12llu %10llu %10llu %10llu %10llu %10llu\n", name, count,
+            mem_histogram_percentile(histogram, 0.5), mem_histogram_percentile(histogram, 0.9),
+            mem_histogram_percentile(histogram, 0.99), mem_histogram_percentile(histogram, 0.999),
+            mem_histogram_percentile(histogram, 1.0));
+}
 
-    // Copy the old data to the new block and free the old block
-    size_t copy_size = header->size < size ? header->size : size; // Copy only what fits
-    memcpy(new_block, block, copy_size); // Use memcpy to copy data
+void mem_profile_dump(FILE* out) {
+    mem_profile_t profile;
+    if (!mem_profile(&profile)) {
+        fprintf(out, "Profiling is not compiled in, build with -DMM_PROFILE.\n");
+        return;
+    }
+    fprintf(out, "%-10s %12s %10s %10s %10s %10s %10s\n", "", "count", "p50", "p90", "p99", "p99.9", "max");
+    profile_print(out, "alloc ns", profile.latency[MEM_OP_ALLOC]);
+    profile_print(out, "free ns", profile.latency[MEM_OP_FREE]);
+    profile_print(out, "resize ns", profile.latency[MEM_OP_RESIZE]);
+    profile_print(out, "scanned", profile.scanned);
+    profile_print(out, "wait ns", profile.lock_wait);
+    profile_print(out, "hold ns", profile.lock_hold);
+    fprintf(out, "Arena locks: %llu taken, %llu contended, %llu ns waiting, %llu ns held.\n",
+            profile.lock_acquires, profile.lock_waits, profile.lock_wait_ns, profile.lock_hold_ns);
+}
 
-    pthread_mutex_unlock(&memory_lock);
+/*Root functions
+*
+*Set and get the root pointer of the default pool, see mem_pool_set_root.
+*/
+void mem_set_root(void* root) {
+    mem_pool_set_root(default_pool, root);
+}
 
-    // Free the old block
-    mem_free(block);
+void* mem_root(void) {
+    return mem_pool_root(default_pool);
+}
 
-    return new_block; // Return the pointer to the new block
+ptrdiff_t mem_moved(void) {
+    return mem_pool_moved(default_pool);
 }
 
 /*Deinit function
@@ -214,26 +2644,228 @@ void mem_deinit() {
 
     pthread_mutex_lock(&memory_lock);
     // Check if the memory pool has already been deinitialized
-    if (heap == NULL) {
+    if (default_pool == NULL) {
         printf("Memory pool is already deinitialized.\n");
         // Unlock mutex before return
         pthread_mutex_unlock(&memory_lock);
         return; // Early return since there's nothing to deinitialize
     }
 
-    // Free all headers
-    Mblock* current = heap_header; // Start from first
-    while (current != NULL) {
-        Mblock* next = current->next; // Store the pointer to the next block header
-        free(current);  // Free the memory allocated for the current block header
-        current = next; // Move to the next block header
-    }
-    // Free the main memory pool
-    free(heap);
-
-    heap_header = NULL; // Reset the header pointer to NULL after freeing all headers
-    heap = NULL; // Set pointer to NULL to avoid dangling references
+    mem_pool_destroy(default_pool);
+    default_pool = NULL; // Set pointer to NULL to avoid dangling references
 
     // Unlock mutex when deinit done
     pthread_mutex_unlock(&memory_lock);
 }
+
+/*Slab allocator
+*
+*Hands out objects of one fixed size in O(1). Objects are carved from chunks allocated from a pool, and freed
+*objects are kept on an intrusive free list (the first bytes of a free object point to the next one).
+*Chunks double in size as the slab grows and are halved when the pool cannot fit them, so a pool sized for
+*exactly n objects still holds n objects. Chunks go back to the pool only when the slab is destroyed.
+*The slab structure and its chunk list are mapped from the system apart from the pool, for the same reason, except in a
+*persistent pool, which keeps them in its file.
+*/
+#define MM_SLAB_FIRST_CHUNK 16    // Objects in the first chunk of a slab
+#define MM_SLAB_MAX_CHUNK 4096    // Most objects in one chunk
+
+struct mem_slab {
+    pthread_mutex_t lock;     // Protects everything below
+    mem_pool_t* pool;         // Pool the chunks are allocated from
+    size_t object_size;       // Size of every object, a whole number of pointers
+    void* free_objects;       // Freed objects, linked through their first bytes
+    char* bump;               // Next never-used object of the newest chunk
+    char* bump_end;           // End of the newest chunk
+    size_t chunk_objects;     // Objects to ask for in the next chunk
+    void** chunks;            // Every chunk taken from the pool
+    size_t chunk_count;
+    size_t chunk_capacity;
+    struct mem_slab* next;    // Next slab of a persistent pool
+};
+
+// Bookkeeping of a slab outside any pool, straight from the system so malloc is never involved
+static void* slab_map(size_t size) {
+    void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return memory == MAP_FAILED ? NULL : memory;
+}
+
+/*Slab creation
+*
+*Creates a slab of objects of object_size bytes allocated from the given pool. Returns NULL if the system is out of memory.
+*/
+mem_slab_t* mem_pool_slab_create(mem_pool_t* pool, size_t object_size) {
+    if (pool == NULL) {
+        return NULL;
+    }
+    // A persistent slab lives in its pool, so it is still there when the pool is reopened
+    mem_slab_t* slab;
+    if (pool->file != NULL) {
+        slab = (mem_slab_t*)pool_alloc(pool, sizeof(mem_slab_t), MM_GRANULE);
+        if (slab == NULL) {
+            return NULL;
+        }
+        memset(slab, 0, sizeof(mem_slab_t));
+        pthread_mutex_lock(&pool->grow_lock);
+        slab->next = pool->slabs;
+        pool->slabs = slab;
+        pthread_mutex_unlock(&pool->grow_lock);
+    } else {
+        slab = (mem_slab_t*)slab_map(sizeof(mem_slab_t));
+        if (slab == NULL) {
+            return NULL;
+        }
+    }
+    pthread_mutex_init(&slab->lock, NULL);
+    slab->pool = pool;
+    // Every object must be able to hold the free list link, and keep the next one pointer aligned
+    if (object_size < sizeof(void*)) {
+        object_size = sizeof(void*);
+    }
+    slab->object_size = (object_size + sizeof(void*) - 1) / sizeof(void*) * sizeof(void*);
+    slab->chunk_objects = MM_SLAB_FIRST_CHUNK;
+    return slab;
+}
+
+// Slab allocating from the default pool
+mem_slab_t* mem_slab_create(size_t object_size) {
+    return mem_pool_slab_create(default_pool, object_size);
+}
+
+// Take a new chunk from the pool, halving the request until it fits. Must be called with the slab lock held.
+static int slab_grow(mem_slab_t* slab) {
+    if (slab->chunk_count == slab->chunk_capacity) {
+        void** chunks;
+        size_t capacity;
+        if (slab->pool->file != NULL) {
+            capacity = slab->chunk_capacity ? slab->chunk_capacity * 2 : 16;
+            chunks = (void**)pool_alloc(slab->pool, capacity * sizeof(void*), MM_GRANULE);
+        } else {
+            // A mapping is whole pages anyway, so the first one is filled
+            capacity = slab->chunk_capacity ? slab->chunk_capacity * 2 : MM_POOL_ALIGN / sizeof(void*);
+            chunks = (void**)slab_map(capacity * sizeof(void*));
+        }
+        if (chunks == NULL) {
+            return 0;
+        }
+        if (slab->chunks != NULL) {
+            memcpy(chunks, slab->chunks, slab->chunk_count * sizeof(void*));
+            if (slab->pool->file != NULL) {
+                mem_pool_free(slab->pool, slab->chunks);
+            } else {
+                munmap(slab->chunks, slab->chunk_capacity * sizeof(void*));
+            }
+        }
+        slab->chunks = chunks;
+        slab->chunk_capacity = capacity;
+    }
+
+    for (size_t objects = slab->chunk_objects; objects > 0; objects /= 2) {
+        char* chunk = (char*)pool_alloc(slab->pool, objects * slab->object_size, MM_GRANULE);
+        if (chunk != NULL) {
+            slab->chunks[slab->chunk_count++] = chunk;
+            slab->bump = chunk;
+            slab->bump_end = chunk + objects * slab->object_size;
+            if (objects == slab->chunk_objects && objects < MM_SLAB_MAX_CHUNK) {
+                slab->chunk_objects = objects * 2;
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*Slab allocation
+*
+*Returns an object from the slab, or NULL if the pool has no room for another one.
+*/
+void* mem_slab_alloc(mem_slab_t* slab) {
+    if (slab == NULL) {
+        return NULL;
+    }
+    pthread_mutex_lock(&slab->lock);
+
+    // Reuse a freed object first, then carve the next one out of the newest chunk
+    void* object = slab->free_objects;
+    if (object != NULL) {
+        slab->free_objects = *(void**)object;
+    } else if (slab->bump < slab->bump_end || slab_grow(slab)) {
+        object = slab->bump;
+        slab->bump += slab->object_size;
+    } else if (!slab->pool->quiet) {
+        printf("Error: No suitable memory block for allocation of size %zu bytes.\n", slab->object_size);
+    }
+
+    pthread_mutex_unlock(&slab->lock);
+    return object;
+}
+
+/*Slab deallocation
+*
+*Gives an object back to its slab.
+*/
+void mem_slab_free(mem_slab_t* slab, void* object) {
+    if (slab == NULL || object == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&slab->lock);
+    *(void**)object = slab->free_objects;
+    slab->free_objects = object;
+    pthread_mutex_unlock(&slab->lock);
+}
+
+/*Slab destruction
+*
+*Returns every chunk to the pool, which frees all objects of the slab at once.
+*/
+void mem_slab_destroy(mem_slab_t* slab) {
+    if (slab == NULL) {
+        return;
+    }
+    mem_pool_t* pool = slab->pool;
+    mem_pool_free_many(pool, slab->chunks, slab->chunk_count);
+    pthread_mutex_destroy(&slab->lock);
+    if (pool->file == NULL) {
+        if (slab->chunks != NULL) {
+            munmap(slab->chunks, slab->chunk_capacity * sizeof(void*));
+        }
+        munmap(slab, sizeof(mem_slab_t));
+        return;
+    }
+
+    pthread_mutex_lock(&pool->grow_lock);
+    for (mem_slab_t** link = &pool->slabs; *link != NULL; link = &(*link)->next) {
+        if (*link == slab) {
+            *link = slab->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pool->grow_lock);
+    mem_pool_free(pool, slab->chunks);
+    mem_pool_free(pool, slab);
+}
+
+// Set up the locks of the slabs of a reopened persistent pool
+static void slabs_reopen(mem_pool_t* pool) {
+    for (mem_slab_t* slab = pool->slabs; slab != NULL; slab = slab->next) {
+        pthread_mutex_init(&slab->lock, NULL);
+    }
+}
+
+// Move the pointers of the slabs of a persistent pool along with it, see pool_relocate
+static void slabs_relocate(mem_pool_t* pool, char* old_base, size_t size, char* new_base) {
+    for (mem_slab_t* slab = pool->slabs; slab != NULL; slab = slab->next) {
+        FILE_REBASE(slab->pool);
+        FILE_REBASE(slab->bump);
+        FILE_REBASE(slab->bump_end);
+        FILE_REBASE(slab->chunks);
+        FILE_REBASE(slab->next);
+        for (size_t i = 0; i < slab->chunk_count; i++) {
+            FILE_REBASE(slab->chunks[i]);
+        }
+        FILE_REBASE(slab->free_objects);
+        for (void** object = (void**)slab->free_objects; object != NULL; object = (void**)*object) {
+            FILE_REBASE(*object);
+        }
+    }
+}
@@ -6,23 +6,156 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <pthread.h>
 
 typedef struct Mblock {
     void* ptr;               // Pointer to the memory allocated
     size_t size;                // Size of the block
     struct Mblock *next;   // Pointer to the next block
+    struct Mblock *prev;   // Pointer to the previous block (address order)
+    struct Mblock *next_free;   // Next free block in the same size class
+    struct Mblock *prev_free;   // Previous free block in the same size class
     int is_free;                // Is this block free? (1 for true, 0 for false)
 } Mblock;
 
+// How threads are assigned a home arena
+typedef enum {
+    MEM_ARENA_ROUND_ROBIN,  // In the order threads first allocate
+    MEM_ARENA_BY_CPU        // By the CPU the thread is running on
+} mem_arena_affinity_t;
+
+// How a free block is picked for a request
+typedef enum {
+    MEM_FIT_SEGREGATED,     // First fit within the request's size class, then the next non-empty class (fastest)
+    MEM_FIT_BEST,           // Smallest free block that fits
+    MEM_FIT_FIRST,          // Lowest-addressed free block that fits
+    MEM_FIT_NEXT,           // First fit, starting after the previous allocation
+    MEM_FIT_BITMAP          // Lowest-addressed fit, found by scanning a bitmap of free granules
+} mem_fit_policy_t;
+
+// How blocks are split and merged
+typedef enum {
+    MEM_BACKEND_LIST,       // Blocks of any granule multiple, coalesced with their neighbours in address order
+    MEM_BACKEND_BUDDY       // Power-of-two blocks, split in halves and merged with their buddy
+} mem_backend_t;
+
+// Where the pool memory comes from
+typedef enum {
+    MEM_PAGES_HEAP,         // calloc
+    MEM_PAGES_MMAP,         // An anonymous mapping, committed as it is used
+    MEM_PAGES_HUGE,         // Like MEM_PAGES_MMAP, aligned to and advised for transparent huge pages
+    MEM_PAGES_HUGETLB       // Explicit huge pages, falling back to MEM_PAGES_HUGE when none are reserved
+} mem_pages_t;
+
+// Options for mem_init_with and mem_pool_create_with, zero-initialize for the defaults
+typedef struct mem_options {
+    int arenas;                       // Number of independent arenas, each with its own lock (0 or 1: one arena)
+    mem_arena_affinity_t affinity;    // How threads pick the arena they allocate from
+    mem_fit_policy_t fit;             // Placement policy (list backend only)
+    mem_backend_t backend;            // Block management
+    int defer_limit;                  // Freed blocks of up to 1 KiB each arena keeps unmerged for reuse (0: merge at once)
+    mem_pages_t pages;                // Backing memory
+    size_t max_size;                  // Size the pool may grow to when it runs out, 0 keeps it at its initial size
+    const char* file;                 // Keep the pool in this file, reopening what is there instead of starting empty
+    int quiet;                        // Report errors only through return values, do not print them
+} mem_options_t;
+
+// A snapshot of a pool, see mem_pool_stats
+typedef struct {
+    size_t size;                      // Bytes of pool data
+    size_t used_bytes;                // Bytes in allocated blocks
+    size_t free_bytes;                // Bytes in free blocks
+    size_t used_blocks;               // Allocated blocks
+    size_t free_blocks;               // Free blocks
+    size_t largest_free;              // Largest free block, and so the largest allocation that can succeed
+    double fragmentation;             // 1 - (sum of each arena's largest free block) / free_bytes, the mean of the
+                                      // arenas' fragmentation weighted by their free bytes: 0 when each arena has
+                                      // its free bytes in one block, whatever the number of arenas
+    size_t trimmed_bytes;             // Free bytes given back to the system by mem_trim
+    long long live_bytes;             // Bytes allocated and not freed, as counted by the calls
+    long long peak_bytes;             // Highest live_bytes so far
+    unsigned long long allocs;        // Blocks allocated
+    unsigned long long frees;         // Blocks freed
+    unsigned long long resizes;       // Resize calls
+} mem_stats_t;
+
+#define MEM_PROFILE_BUCKETS 128       // Histogram buckets, four per power of two, see mem_profile_bucket_floor
+
+// Calls timed by the profile
+typedef enum {
+    MEM_OP_ALLOC,                     // mem_alloc and friends, including the allocation of a resize that moves a block
+    MEM_OP_FREE,                      // mem_free, likewise
+    MEM_OP_RESIZE,                    // mem_resize
+    MEM_OPS
+} mem_op_t;
+
+// Latency and contention profile of the process, see mem_profile (libraries built with -DMM_PROFILE only)
+typedef struct {
+    unsigned long long latency[MEM_OPS][MEM_PROFILE_BUCKETS];  // Calls per bucket of nanoseconds taken
+    unsigned long long scanned[MEM_PROFILE_BUCKETS];           // Fit searches per bucket of blocks visited
+    unsigned long long lock_wait[MEM_PROFILE_BUCKETS];         // Contended arena lock acquisitions per bucket of ns waited
+    unsigned long long lock_hold[MEM_PROFILE_BUCKETS];         // Arena lock releases per bucket of ns held
+    unsigned long long lock_acquires;                          // Arena locks taken
+    unsigned long long lock_waits;                             // Of those, taken after waiting for another thread
+    unsigned long long lock_wait_ns;                           // Nanoseconds spent waiting for arena locks
+    unsigned long long lock_hold_ns;                           // Nanoseconds arena locks were held
+} mem_profile_t;
+
+// An independent memory pool, the mem_* functions below work on a default one
+typedef struct mem_pool mem_pool_t;
+
+// A cache of fixed-size objects carved out of a pool
+typedef struct mem_slab mem_slab_t;
+
 // Declare the mutex for the memory manager
 extern pthread_mutex_t list_lock;
 
 //declare functions
 void mem_init(size_t size);
+int mem_init_with(size_t size, const mem_options_t* options);
 void* mem_alloc(size_t size);
+void* mem_alloc_aligned(size_t size, size_t alignment);
 void mem_free(void* block);
 void* mem_resize(void* block, size_t size);
+size_t mem_alloc_many(size_t size, size_t count, void** out);
+void mem_free_many(void** blocks, size_t count);
+size_t mem_usable_size(void* block);
+size_t mem_trim(void);
+mem_stats_t mem_stats(void);
+void mem_set_root(void* root);
+void* mem_root(void);
+ptrdiff_t mem_moved(void);
 void mem_deinit();
 
+//declare profile functions
+int mem_profile(mem_profile_t* profile);
+void mem_profile_reset(void);
+void mem_profile_dump(FILE* out);
+unsigned long long mem_profile_bucket_floor(int bucket);
+
+//declare pool functions
+mem_pool_t* mem_pool_create(size_t size);
+mem_pool_t* mem_pool_create_with(size_t size, const mem_options_t* options);
+void* mem_pool_alloc(mem_pool_t* pool, size_t size);
+void* mem_pool_alloc_aligned(mem_pool_t* pool, size_t size, size_t alignment);
+void mem_pool_free(mem_pool_t* pool, void* block);
+void* mem_pool_resize(mem_pool_t* pool, void* block, size_t size);
+size_t mem_pool_alloc_many(mem_pool_t* pool, size_t size, size_t count, void** out);
+void mem_pool_free_many(mem_pool_t* pool, void** blocks, size_t count);
+size_t mem_pool_usable_size(mem_pool_t* pool, void* block);
+size_t mem_pool_trim(mem_pool_t* pool);
+mem_stats_t mem_pool_stats(mem_pool_t* pool);
+void mem_pool_set_root(mem_pool_t* pool, void* root);
+void* mem_pool_root(mem_pool_t* pool);
+ptrdiff_t mem_pool_moved(mem_pool_t* pool);
+void mem_pool_destroy(mem_pool_t* pool);
+
+//declare slab functions
+mem_slab_t* mem_slab_create(size_t object_size);
+mem_slab_t* mem_pool_slab_create(mem_pool_t* pool, size_t object_size);
+void* mem_slab_alloc(mem_slab_t* slab);
+void mem_slab_free(mem_slab_t* slab, void* object);
+void mem_slab_destroy(mem_slab_t* slab);
+
 #endif // MEMORY_MANAGER_H
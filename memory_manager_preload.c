@@ -0,0 +1,226 @@
+/*Petter Eriksson, 2024-10-04, git: Milloz-dev*, peer22@student.bth.se*/
+#define _GNU_SOURCE  // For sched_getaffinity
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include "memory_manager.h"
+
+/*Process allocator
+*
+*Preload this library (LD_PRELOAD=./libmemory_manager_preload.so program) to serve every malloc, free, calloc,
+*realloc, memalign, posix_memalign, aligned_alloc, valloc, pvalloc and malloc_usable_size of a program from one
+*memory pool. The pool is reserved with mmap and committed as it is used, with one arena per CPU the process may run
+*on, and grows when it runs out. These environment variables change that:
+*
+*  MM_PRELOAD_SIZE    bytes the pool starts with (default 64 MiB)
+*  MM_PRELOAD_MAX     bytes the pool may grow to (default 16 GiB)
+*  MM_PRELOAD_ARENAS  number of arenas
+*
+*The pool is created by the first call. Anything allocated while it is being created comes from a small bootstrap
+*arena, which is never reused. Pointers that are neither the pool's nor the bootstrap arena's (memory the dynamic
+*loader got before the program started) are ignored by free, and realloc moves them to a new block without freeing
+*them. Their size is unknown, so it copies what is certainly there to read: up to the end of the page they start on.
+*/
+#define PRELOAD_SIZE (64UL * 1024 * 1024)
+#define PRELOAD_MAX (16UL * 1024 * 1024 * 1024)
+#define PRELOAD_BOOT_BYTES 65536     // Bootstrap arena, for allocations made while the pool is created
+#define PRELOAD_ALIGN 16             // Alignment of malloc, like the pool's granule
+
+static mem_pool_t* pool = NULL;      // The pool behind it all, NULL until created
+static int pool_state = 0;           // 0: not created, 1: being created, 2: created (then pool is set)
+static __thread int creating __attribute__((tls_model("initial-exec"))) = 0;  // This thread is creating the pool
+
+static _Alignas(PRELOAD_ALIGN) char boot_arena[PRELOAD_BOOT_BYTES];
+static size_t boot_used = 0;
+
+// Bump allocation from the bootstrap arena, only ever by the thread creating the pool
+static void* boot_alloc(size_t size, size_t alignment) {
+    size_t start = (boot_used + alignment - 1) & ~(alignment - 1);
+    if (start + size > sizeof(boot_arena) || start + size < start) {
+        return NULL;
+    }
+    boot_used = start + size;
+    return boot_arena + start;
+}
+
+static int is_boot(void* ptr) {
+    return (char*)ptr >= boot_arena && (char*)ptr < boot_arena + sizeof(boot_arena);
+}
+
+static size_t env_size(const char* name, size_t fallback) {
+    const char* value = getenv(name);
+    if (value == NULL || value[0] == '\0') {
+        return fallback;
+    }
+    size_t parsed = (size_t)strtoull(value, NULL, 0);
+    return parsed > 0 ? parsed : fallback;
+}
+
+static void create_pool(void) {
+    mem_options_t options;
+    memset(&options, 0, sizeof(options));
+    options.pages = MEM_PAGES_MMAP;
+    options.affinity = MEM_ARENA_BY_CPU;
+    options.quiet = 1;  // malloc has errno, and printing would call malloc again
+
+    cpu_set_t cpus;
+    int cpu_count = sched_getaffinity(0, sizeof(cpus), &cpus) == 0 ? CPU_COUNT(&cpus) : 1;
+    options.arenas = (int)env_size("MM_PRELOAD_ARENAS", (size_t)cpu_count);
+    size_t size = env_size("MM_PRELOAD_SIZE", PRELOAD_SIZE);
+    options.max_size = env_size("MM_PRELOAD_MAX", PRELOAD_MAX);
+
+    mem_pool_t* created = mem_pool_create_with(size, &options);
+    if (created == NULL) {
+        static const char message[] = "Error: Cannot create the memory pool for the process.\n";
+        ssize_t ignored = write(2, message, sizeof(message) - 1);
+        (void)ignored;
+        abort();
+    }
+    __atomic_store_n(&pool, created, __ATOMIC_RELEASE);
+    __atomic_store_n(&pool_state, 2, __ATOMIC_RELEASE);
+}
+
+// The pool, created on first use; NULL while this thread is creating it
+static mem_pool_t* get_pool(void) {
+    mem_pool_t* current = __atomic_load_n(&pool, __ATOMIC_ACQUIRE);
+    if (current != NULL) {
+        return current;
+    }
+    if (creating) {
+        return NULL;
+    }
+    int state = 0;
+    if (__atomic_compare_exchange_n(&pool_state, &state, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        creating = 1;
+        create_pool();
+        creating = 0;
+    } else {
+        while (__atomic_load_n(&pool_state, __ATOMIC_ACQUIRE) != 2) {
+            sched_yield();
+        }
+    }
+    return __atomic_load_n(&pool, __ATOMIC_ACQUIRE);
+}
+
+static void* preload_alloc(size_t size, size_t alignment) {
+    mem_pool_t* current = get_pool();
+    void* block = current != NULL ? mem_pool_alloc_aligned(current, size, alignment) : boot_alloc(size, alignment);
+    if (block == NULL) {
+        errno = ENOMEM;
+    }
+    return block;
+}
+
+static int power_of_two(size_t value) {
+    return value != 0 && (value & (value - 1)) == 0;
+}
+
+/*=========================================================
+ * the malloc family
+ */
+
+void* malloc(size_t size) {
+    return preload_alloc(size, PRELOAD_ALIGN);
+}
+
+void free(void* ptr) {
+    if (ptr == NULL || is_boot(ptr)) {
+        return;  // The bootstrap arena is never reused
+    }
+    mem_pool_t* current = get_pool();
+    if (current != NULL) {
+        mem_pool_free(current, ptr);  // Quiet, so foreign pointers are left alone
+    }
+}
+
+void* calloc(size_t nmemb, size_t size) {
+    if (size != 0 && nmemb > (size_t)-1 / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    void* block = preload_alloc(nmemb * size, PRELOAD_ALIGN);
+    if (block != NULL && !is_boot(block)) {
+        memset(block, 0, nmemb * size);  // The bootstrap arena is zero already
+    }
+    return block;
+}
+
+void* realloc(void* ptr, size_t size) {
+    if (ptr == NULL) {
+        return malloc(size);
+    }
+    if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
+    if (is_boot(ptr)) {
+        // Bootstrap blocks do not know their size, copy as much as there may be
+        void* moved = malloc(size);
+        if (moved != NULL) {
+            size_t left = (size_t)(boot_arena + sizeof(boot_arena) - (char*)ptr);
+            memcpy(moved, ptr, size < left ? size : left);
+        }
+        return moved;
+    }
+    mem_pool_t* current = get_pool();
+    if (current == NULL) {
+        errno = ENOMEM;  // Only while this thread creates the pool, which never reallocates
+        return NULL;
+    }
+    if (mem_pool_usable_size(current, ptr) == 0) {
+        // Not a block of ours, left alone like free does
+        void* moved = malloc(size);
+        if (moved != NULL) {
+            size_t page = (size_t)sysconf(_SC_PAGESIZE);
+            size_t left = page - (uintptr_t)ptr % page;
+            memcpy(moved, ptr, size < left ? size : left);
+        }
+        return moved;
+    }
+    void* moved = mem_pool_resize(current, ptr, size);
+    if (moved == NULL) {
+        errno = ENOMEM;
+    }
+    return moved;
+}
+
+void* memalign(size_t alignment, size_t size) {
+    if (!power_of_two(alignment)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return preload_alloc(size, alignment > PRELOAD_ALIGN ? alignment : PRELOAD_ALIGN);
+}
+
+int posix_memalign(void** memptr, size_t alignment, size_t size) {
+    if (!power_of_two(alignment) || alignment % sizeof(void*) != 0) {
+        return EINVAL;
+    }
+    void* block = preload_alloc(size, alignment > PRELOAD_ALIGN ? alignment : PRELOAD_ALIGN);
+    if (block == NULL) {
+        return ENOMEM;
+    }
+    *memptr = block;
+    return 0;
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+void* valloc(size_t size) {
+    return memalign((size_t)sysconf(_SC_PAGESIZE), size);
+}
+
+void* pvalloc(size_t size) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    return memalign(page, (size + page - 1) / page * page);
+}
+
+size_t malloc_usable_size(void* ptr) {
+    if (ptr == NULL || is_boot(ptr)) {
+        return 0;
+    }
+    mem_pool_t* current = get_pool();
+    return current != NULL ? mem_pool_usable_size(current, ptr) : 0;
+}
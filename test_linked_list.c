@@ -5,6 +5,9 @@
 #include <time.h>
 #include <stddef.h>
 #include <math.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/mman.h>
 #include "common_defs.h"
 #include "gitdata.h"
 
@@ -514,11 +517,105 @@ void test_list_cleanup()
     list_insert(&head, 20);
     list_insert(&head, 30);
 
+    list_cleanup(&head);
+    my_assert(head == NULL);
+
+    // The list can be used again once there is a pool, without list_init
+    mem_init(sizeof(Node) * 3);
+    list_insert(&head, 40);
+    my_assert(list_count_nodes(&head) == 1);
+    my_assert(head->data == 40);
     list_cleanup(&head);
     my_assert(head == NULL);
     printf_green("[PASS].\n");
 }
 
+void test_list_open_close()
+{
+    printf_yellow("  Testing list_open and list_close ---> ");
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/test_linked_list_%d.pool", (int)getpid());
+    unlink(path);
+    Node *head = NULL;
+
+    my_assert(list_open(&head, sizeof(Node) * 1024, path) == 0);
+    my_assert(head == NULL);
+    for (int i = 0; i < 1000; i++)
+    {
+        list_insert(&head, i);
+    }
+    list_close(&head);
+    my_assert(head == NULL);
+
+    // Back without inserting anything again
+    list_open(&head, sizeof(Node) * 1024, path);
+    my_assert(list_count_nodes(&head) == 1000);
+    my_assert(head->data == 0);
+    list_delete(&head, 0);
+    list_insert(&head, 1000);
+    Node *saved = head;
+    list_close(&head);
+
+    // With its address taken the pool opens elsewhere, and the list comes along
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    void *taken = (void *)((uintptr_t)saved & ~(uintptr_t)(page - 1));
+    my_assert(mmap(taken, page, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) == taken);
+    my_assert(list_open(&head, sizeof(Node) * 1024, path) == 0);
+    my_assert(head != saved);
+    my_assert(list_count_nodes(&head) == 1000);
+    my_assert(head->data == 1);
+    my_assert(list_search(&head, 1000) != NULL);
+    list_delete(&head, 500);
+    list_close(&head);
+    munmap(taken, page);
+
+    // The freed node is reused where the list is now
+    my_assert(list_open(&head, sizeof(Node) * 1024, path) == 0);
+    my_assert(list_count_nodes(&head) == 999);
+    list_insert(&head, 500);
+    my_assert(list_count_nodes(&head) == 1000);
+    my_assert(list_search(&head, 500) != NULL);
+    list_cleanup(&head);
+
+    // Cleaned up, the file holds an empty list
+    list_open(&head, sizeof(Node) * 1024, path);
+    my_assert(head == NULL);
+
+    // list_init leaves an open persistent list alone, it is still there and saved by list_close
+    list_insert(&head, 7);
+    Node *other = NULL;
+    list_init(&other, sizeof(Node) * 16);
+    my_assert(other == NULL);
+    list_insert(&head, 8);
+    my_assert(list_count_nodes(&head) == 2);
+    list_close(&head);
+    my_assert(list_open(&head, sizeof(Node) * 1024, path) == 0);
+    my_assert(list_count_nodes(&head) == 2 && head->data == 7 && head->next->data == 8);
+    list_cleanup(&head);
+
+    // And once the list is closed, list_init works as ever
+    list_init(&head, sizeof(Node) * 16);
+    list_insert(&head, 9);
+    my_assert(list_count_nodes(&head) == 1);
+    list_cleanup(&head);
+    unlink(path);
+
+    // A pool with no room for the list fails to open, and the list stays unusable instead of crashing
+    my_assert(list_open(&head, 1, path) == -1);
+    my_assert(head == NULL);
+    list_insert(&head, 1);
+    my_assert(head == NULL);
+    list_close(&head);
+
+    // So does a file that cannot be opened, without ending the program
+    my_assert(list_open(&head, sizeof(Node) * 1024, "/nonexistent/test_linked_list.pool") == -1);
+    my_assert(head == NULL);
+    list_close(&head);
+
+    unlink(path);
+    printf_green("[PASS].\n");
+}
+
 // ********* Stress and edge cases *********
 
 void test_list_insert_loop(int count)
@@ -670,6 +767,7 @@ int main(int argc, char *argv[])
         printf(" 6. test_list_insert_after - Test multiple insertions after a given node\n");
         printf(" 7. test_list_insert_after - Test multiple insertions after a given node\n");
         printf(" 8. test_list_delete - Test multiple detelions\n");
+        printf(" 9. test_list_open_close - Test a list kept in a pool file\n");
         printf(" 0. Run all tests\n");
         return 1;
     }
@@ -685,6 +783,8 @@ int main(int argc, char *argv[])
         test_list_insert_after_multithread(&(TestParams){.num_threads = base_num_threads, .num_nodes = 1024});
         test_list_insert_before_multithreaded(&(TestParams){.num_threads = base_num_threads, .num_nodes = 1024});
         test_list_delete_multithreaded(&(TestParams){.num_threads = base_num_threads, .num_nodes = 1024});
+        test_list_cleanup();
+        test_list_open_close();
 
         printf("\nStress testing basic operations with various numbers of threads and nodes:\n");
         for (int i = 0; i < 9; i++)      // from 2^0 = 1 up to 2^8 = 256 threads
@@ -729,6 +829,9 @@ int main(int argc, char *argv[])
             for (int j = 8; j < 14; j++) // from 2^8 = 256 up to 2^14 = 16384 nodes
                 test_list_delete_multithreaded(&(TestParams){.num_threads = pow(2, i), .num_nodes = pow(2, j)});
         break;
+    case 9:
+        test_list_open_close();
+        break;
 
     default:
         printf("Invalid test function\n");
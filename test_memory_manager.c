@@ -11,6 +11,7 @@
 #include <dlfcn.h>
 #include <sys/mman.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 #include "common_defs.h"
 
 #include <unistd.h>
@@ -42,8 +43,16 @@ typedef struct
     int num_blocks;
     size_t block_size;
     bool simulate_work;
+    int arenas; // Number of arenas to split the pool into, 0 for a single one
+    mem_fit_policy_t fit; // Placement policy, segregated fit by default
+    mem_backend_t backend; // Block management, the list backend by default
+    int defer_limit; // Freed blocks kept unmerged per arena, 0 merges at once
+    bool batched; // Allocate and free with mem_alloc_many and mem_free_many
 } TestParams;
 
+// Names of the placement policies, for reporting
+const char *fit_names[] = {"segregated", "best", "first", "next", "bitmap"};
+
 // Function to calculate memory allocations for threads based on redistribution logic
 size_t *calculate_thread_allocations(int num_threads, size_t total_memory)
 {
@@ -150,7 +159,8 @@ void testAcrossConfigurations(void (*test_func)(TestParams), TestParams params)
 void run_concurrent_test(void *(*test_func)(void *), TestParams params, char *function_name)
 {
     printf_yellow("  Testing \"%s\" (threads: %d, mem_size: %zu) ---> ", function_name, params.num_threads, params.memory_size);
-    mem_init(params.memory_size);
+    // Every block is rounded up to a 16-byte granule, so each thread's two blocks may take up to 15 bytes more each
+    mem_init(params.memory_size + (size_t)params.num_threads * 2 * 15);
     pthread_t threads[params.num_threads];
     my_barrier_init(&barrier, params.num_threads);
     thread_data_t params_t[params.num_threads];
@@ -551,7 +561,9 @@ void *thread_overcommit_alloc(void *arg)
 
 void test_memory_overcommit_multithread(TestParams params)
 {
-    printf_yellow("  Testing \"memory overcommitment\" (threads: %d, mem_size: %zu) ---> ", params.num_threads, params.memory_size);
+    printf_yellow("  Testing \"memory overcommitment\" (threads: %d, mem_size: %zu, fit: %s) ---> ", params.num_threads, params.memory_size, fit_names[params.fit]);
+    struct timeval start_time, end_time;
+    gettimeofday(&start_time, NULL); // Start timing
 
     pthread_t threads[params.num_threads];
     thread_data_t params_t[params.num_threads];
@@ -559,7 +571,7 @@ void test_memory_overcommit_multithread(TestParams params)
     my_barrier_init(&barrier, params.num_threads); // Initialize the barrier
 
     size_t memory_per_thread = params.memory_size / params.num_threads; // Each thread tries to allocate 1KB
-    mem_init(params.memory_size);                                       // Initialize with 1KB of memory, intentionally less than required per thread
+    mem_init_with(params.memory_size, &(mem_options_t){.fit = params.fit}); // Initialize with 1KB of memory, intentionally less than required per thread
 
     // Setup thread parameters and create threads
     for (int i = 0; i < params.num_threads; i++)
@@ -588,6 +600,10 @@ void test_memory_overcommit_multithread(TestParams params)
     mem_deinit();                 // Clean up the memory manager
     my_barrier_destroy(&barrier); // Destroy the barrier
 
+    gettimeofday(&end_time, NULL); // End timing
+    long micros = (end_time.tv_sec - start_time.tv_sec) * 1000000 + end_time.tv_usec - start_time.tv_usec;
+    printf_yellow("Time: %ld microseconds.\t", micros);
+
     if (failures == 0)
     {
         printf_green("[PASS].\n");
@@ -624,13 +640,15 @@ void *thread_repeated_fit_reuse(void *arg)
 void test_repeated_fit_reuse_multithread(TestParams params)
 {
     //  int iterations, int num_threads, int mem_size, int num_blocks
-    printf_yellow("  Testing \"repeated exact fit reuse\" (num_threads: %d, memory_size: %zu, repeat: %d) ---> ", params.num_threads, params.memory_size, params.iterations);
+    printf_yellow("  Testing \"repeated exact fit reuse\" (num_threads: %d, memory_size: %zu, repeat: %d, defer: %d) ---> ", params.num_threads, params.memory_size, params.iterations, params.defer_limit);
+    struct timeval start_time, end_time;
+    gettimeofday(&start_time, NULL); // Start timing
 
     pthread_t threads[params.num_threads];
     thread_data_t params_t[params.num_threads];
     size_t block_size = params.memory_size / params.num_threads; // Size of each memory block
 
-    mem_init(params.memory_size); // Initialize with 1KB of memory, enough for all threads if they reuse properly
+    mem_init_with(params.memory_size, &(mem_options_t){.defer_limit = params.defer_limit}); // Initialize with 1KB of memory, enough for all threads if they reuse properly
 
     // Prepare parameters for each thread
     for (int i = 0; i < params.num_threads; i++)
@@ -663,6 +681,10 @@ void test_repeated_fit_reuse_multithread(TestParams params)
 
     mem_deinit(); // Clean up the memory manager
 
+    gettimeofday(&end_time, NULL); // End timing
+    long micros = (end_time.tv_sec - start_time.tv_sec) * 1000000 + end_time.tv_usec - start_time.tv_usec;
+    printf_yellow("Time: %ld microseconds.\t", micros);
+
     if (failures == 0)
     {
         printf_green("[PASS].\n");
@@ -704,6 +726,7 @@ void *repeated_allocate_in_fragment(void *arg)
 {
     thread_data_t *data = (thread_data_t *)arg;
     int cycles = data->iterations; // Number of allocation attempts per thread
+    long failures = 0;
 
     for (int i = 0; i < cycles; i++)
     {
@@ -719,6 +742,7 @@ void *repeated_allocate_in_fragment(void *arg)
         }
         else
         {
+            failures++;
             if (debug)
                 printf_red("    Thread %d failed to allocate %zu bytes in fragmented memory\n", data->thread_id, data->block_size);
         }
@@ -726,13 +750,15 @@ void *repeated_allocate_in_fragment(void *arg)
         my_barrier_wait(&barrier); // Synchronize before the next cycle
     }
 
-    return NULL;
+    return (void *)failures; // Allocations that did not fit, a measure of fragmentation
 }
 
 void test_memory_fragmentation_multithread(TestParams params)
 {
-    printf_yellow("  Testing \"memory fragmentation handling\" (threads: %d, mem_size: %zu, iterations: %d) ---> ", params.num_threads, params.memory_size, params.iterations);
-    mem_init(params.memory_size); // Initialize with specified memory size to accommodate load
+    printf_yellow("  Testing \"memory fragmentation handling\" (threads: %d, mem_size: %zu, iterations: %d, fit: %s) ---> ", params.num_threads, params.memory_size, params.iterations, fit_names[params.fit]);
+    struct timeval start_time, end_time;
+    gettimeofday(&start_time, NULL); // Start timing
+    mem_init_with(params.memory_size, &(mem_options_t){.fit = params.fit}); // Initialize with specified memory size to accommodate load
 
     pthread_t threads[params.num_threads];
     thread_data_t params_t[params.num_threads]; // Array of thread data
@@ -761,14 +787,21 @@ void test_memory_fragmentation_multithread(TestParams params)
         }
     }
 
-    // Wait for all threads to finish
+    // Wait for all threads to finish and count the allocations that did not fit
+    long failures = 0;
+    void *status;
     for (int i = 0; i < params.num_threads; i++)
     {
-        pthread_join(threads[i], NULL);
+        pthread_join(threads[i], &status);
+        failures += (long)status;
     }
 
     mem_deinit(); // Clean up the memory manager
     my_barrier_destroy(&barrier);
+
+    gettimeofday(&end_time, NULL); // End timing
+    long micros = (end_time.tv_sec - start_time.tv_sec) * 1000000 + end_time.tv_usec - start_time.tv_usec;
+    printf_yellow("Time: %ld microseconds, failed fills: %ld.\t", micros, failures);
     printf_green("[PASS].\n");
 }
 
@@ -811,16 +844,43 @@ void *thread_function(void *arg)
     return NULL;
 }
 
+// Same as thread_function, but allocating and freeing all blocks in one batch each
+void *thread_function_batched(void *arg)
+{
+    thread_data_t *params = (thread_data_t *)arg;
+    int thread_id = params->thread_id;
+    int num_allocations = params->num_blocks;
+    size_t block_size = params->block_size;
+
+    char **blocks = (char **)malloc(num_allocations * sizeof(char *));
+    my_assert(blocks != NULL); // Check that allocation was successful
+
+    my_assert(mem_alloc_many(block_size, num_allocations, (void **)blocks) == (size_t)num_allocations);
+    for (int i = 0; i < num_allocations; i++)
+    {
+        memset(blocks[i], thread_id * num_allocations + i, block_size);
+    }
+
+    for (int i = 0; i < num_allocations; i++)
+    {
+        sanityCheck(block_size, blocks[i], (char)(thread_id * num_allocations + i));
+    }
+    mem_free_many((void **)blocks, num_allocations);
+    free(blocks);
+
+    return NULL;
+}
+
 void run_concurrency_test(TestParams params)
 {
-    printf_yellow("  Running concurrency test with %d threads, %d allocations per thread, and block size %zu bytes --> ", params.num_threads, params.num_blocks / params.num_threads, params.block_size);
+    printf_yellow("  Running concurrency test with %d threads, %d allocations per thread, block size %zu bytes, %d arenas and the %s backend --> ", params.num_threads, params.num_blocks / params.num_threads, params.block_size, params.arenas > 1 ? params.arenas : 1, params.backend == MEM_BACKEND_BUDDY ? "buddy" : "list");
     struct timeval start_time, end_time;
     gettimeofday(&start_time, NULL); // Start timing
     pthread_t threads[params.num_threads];
     thread_data_t params_t[params.num_threads];
     my_barrier_init(&barrier, params.num_threads);
     // Initialize your memory manager here
-    mem_init(params.num_blocks * params.block_size); // Initialize with enough memory for the test
+    mem_init_with(params.num_blocks * params.block_size, &(mem_options_t){.arenas = params.arenas, .backend = params.backend}); // Initialize with enough memory for the test
 
     // Create multiple threads to perform memory operations
     for (int i = 0; i < params.num_threads; i++)
@@ -829,7 +889,7 @@ void run_concurrency_test(TestParams params)
         params_t[i].num_blocks = params.num_blocks / params.num_threads;
         params_t[i].block_size = params.block_size;
         params_t[i].simulate_work = params.simulate_work;
-        pthread_create(&threads[i], NULL, thread_function, &params_t[i]);
+        pthread_create(&threads[i], NULL, params.batched ? thread_function_batched : thread_function, &params_t[i]);
     }
 
     // Join all threads
@@ -851,6 +911,875 @@ void run_concurrency_test(TestParams params)
     printf_green("[PASS].\n");
 }
 
+/*
+ * This function checks that freeing pointers that do not start a block (interior pointers, pointers outside the pool)
+ * and freeing the same block twice are rejected without corrupting the pool.
+ * The test passes if the whole pool can still be allocated as one block afterwards.
+ */
+void test_invalid_and_double_free()
+{
+    printf_yellow("  Testing \"invalid and double mem_free\" ---> ");
+    mem_init(1024);
+
+    char *block1 = (char *)mem_alloc(100);
+    char *block2 = (char *)mem_alloc(200);
+    my_assert(block1 != NULL && block2 != NULL);
+
+    int outside = 0;
+    mem_free(block1 + 10); // Interior pointer, not the start of a block
+    mem_free(&outside);    // Pointer outside the pool
+    mem_free(block1);
+    mem_free(block1);      // Double free
+
+    memset(block2, 0x5A, 200);
+    sanityCheck(200, block2, 0x5A);
+    mem_free(block2);
+
+    void *whole = mem_alloc(1024);
+    my_assert(whole != NULL);
+    mem_free(whole);
+
+    mem_deinit();
+    printf_green("[PASS].\n");
+}
+
+/*
+ * This function is used to test that blocks freed into per-thread caches are not stranded when the threads exit.
+ * Each thread allocates and frees a set of small blocks, then exits.
+ * The test passes if the main thread can afterwards allocate the whole pool as a single block.
+ */
+void *thread_small_churn(void *arg)
+{
+    thread_data_t *data = (thread_data_t *)arg;
+    void *blocks[16];
+
+    for (int i = 0; i < data->iterations; i++)
+    {
+        for (int j = 0; j < 16; j++)
+        {
+            blocks[j] = mem_alloc(data->block_size);
+            my_assert(blocks[j] != NULL);
+        }
+        for (int j = 0; j < 16; j++)
+        {
+            mem_free(blocks[j]);
+        }
+    }
+
+    return NULL;
+}
+
+void test_thread_cache_drain_multithread(TestParams params)
+{
+    printf_yellow("  Testing \"thread cache drain on exit\" (threads: %d) ---> ", params.num_threads);
+
+    size_t block_size = 64;
+    size_t memory_size = params.num_threads * 16 * block_size;
+    pthread_t threads[params.num_threads];
+    thread_data_t params_t[params.num_threads];
+
+    mem_init(memory_size);
+
+    for (int i = 0; i < params.num_threads; i++)
+    {
+        params_t[i].thread_id = i;
+        params_t[i].block_size = block_size;
+        params_t[i].iterations = params.iterations;
+        if (pthread_create(&threads[i], NULL, thread_small_churn, &params_t[i]) != 0)
+        {
+            perror("Failed to create thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (int i = 0; i < params.num_threads; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    void *whole = mem_alloc(memory_size);
+    mem_free(whole);
+    mem_deinit();
+
+    if (whole != NULL)
+    {
+        printf_green("[PASS].\n");
+    }
+    else
+    {
+        printf_red("[FAIL]: Blocks were left behind in the caches of exited threads.\n");
+    }
+}
+
+/*
+ * This function checks that pools created with mem_pool_create are independent of each other and of the default pool.
+ * Each pool is filled completely, a block of one pool is not accepted by the other, and destroying one pool
+ * leaves the other intact. Calling mem_init twice must replace the default pool rather than keep the old one.
+ */
+void test_independent_pools()
+{
+    printf_yellow("  Testing \"independent pools\" ---> ");
+    mem_init(1024);
+    mem_init(1024); // Replaces the first default pool
+
+    mem_pool_t *pool1 = mem_pool_create(1024);
+    mem_pool_t *pool2 = mem_pool_create(512);
+    my_assert(pool1 != NULL && pool2 != NULL);
+
+    char *whole = (char *)mem_alloc(1024);
+    char *block1 = (char *)mem_pool_alloc(pool1, 1024);
+    char *block2 = (char *)mem_pool_alloc(pool2, 512);
+    my_assert(whole != NULL && block1 != NULL && block2 != NULL);
+
+    memset(whole, 0x11, 1024);
+    memset(block1, 0x22, 1024);
+    memset(block2, 0x33, 512);
+
+    mem_pool_free(pool2, block1); // Not a block of pool2
+    sanityCheck(1024, block1, 0x22);
+
+    mem_pool_destroy(pool2);
+    sanityCheck(1024, whole, 0x11);
+    sanityCheck(1024, block1, 0x22);
+
+    mem_pool_free(pool1, block1);
+    block1 = (char *)mem_pool_alloc(pool1, 1024);
+    my_assert(block1 != NULL);
+    mem_pool_free(pool1, block1);
+
+    mem_pool_destroy(pool1);
+    mem_free(whole);
+    mem_deinit();
+    printf_green("[PASS].\n");
+}
+
+/*
+ * This function checks the slab allocator for fixed-size objects.
+ * A pool sized for exactly count objects must hold count objects, freed objects must be reused,
+ * and destroying the slab must give the whole pool back.
+ */
+void test_slab_alloc_and_free()
+{
+    printf_yellow("  Testing \"slab alloc and free\" ---> ");
+    const int count = 100;
+    size_t object_size = 16;
+    void *objects[count];
+
+    mem_init(count * object_size);
+    mem_slab_t *slab = mem_slab_create(object_size);
+    my_assert(slab != NULL);
+
+    for (int i = 0; i < count; i++)
+    {
+        objects[i] = mem_slab_alloc(slab);
+        my_assert(objects[i] != NULL);
+        memset(objects[i], i, object_size);
+    }
+    for (int i = 0; i < count; i++)
+    {
+        sanityCheck(object_size, objects[i], i);
+    }
+
+    mem_slab_free(slab, objects[42]);
+    my_assert(mem_slab_alloc(slab) == objects[42]);
+
+    mem_slab_destroy(slab);
+    void *whole = mem_alloc(count * object_size);
+    my_assert(whole != NULL);
+    mem_free(whole);
+
+    mem_deinit();
+    printf_green("[PASS].\n");
+}
+
+/*
+ * This function checks where each placement policy puts a block when the pool has two holes and a free tail:
+ * first fit and the bitmap take the lowest hole, best fit the smallest one, next fit continues at the tail after the last
+ * allocation, and segregated fit takes a hole from the lowest size class that fits.
+ * Blocks are larger than the thread caches hold, so every free goes straight back to the pool.
+ */
+void test_fit_policies()
+{
+    printf_yellow("  Testing \"placement policies\" ---> ");
+
+    for (int fit = MEM_FIT_SEGREGATED; fit <= MEM_FIT_BITMAP; fit++)
+    {
+        mem_init_with(4096, &(mem_options_t){.fit = fit});
+
+        char *large_hole = (char *)mem_alloc(1024);
+        char *guard1 = (char *)mem_alloc(272);
+        char *small_hole = (char *)mem_alloc(512);
+        char *guard2 = (char *)mem_alloc(272);
+        my_assert(large_hole != NULL && guard1 != NULL && small_hole != NULL && guard2 != NULL);
+        mem_free(large_hole);
+        mem_free(small_hole);
+
+        char *block = (char *)mem_alloc(400);
+        char *expected = fit == MEM_FIT_FIRST || fit == MEM_FIT_BITMAP ? large_hole : fit == MEM_FIT_NEXT ? guard2 + 272 : small_hole;
+        my_assert(block == expected);
+
+        mem_free(block);
+        mem_free(guard1);
+        mem_free(guard2);
+        mem_deinit();
+    }
+
+    printf_green("[PASS].\n");
+}
+
+/*
+ * This function checks block alignment: every block is aligned for any object type, mem_alloc_aligned honours
+ * cache line and page alignment, and the padding in front of an aligned block can still be allocated.
+ * Sizes and alignments too large to pad are refused rather than wrapped around.
+ * The test passes if the whole pool can be allocated as one block after everything is freed.
+ */
+void test_aligned_alloc()
+{
+    printf_yellow("  Testing \"aligned allocation\" ---> ");
+    mem_init(16384);
+
+    char *odd = (char *)mem_alloc(17);
+    char *line = (char *)mem_alloc_aligned(100, 64);
+    char *page = (char *)mem_alloc_aligned(4096, 4096);
+    char *padding = (char *)mem_alloc(32);
+    my_assert(odd != NULL && line != NULL && page != NULL && padding != NULL);
+
+    my_assert((uintptr_t)odd % _Alignof(max_align_t) == 0);
+    my_assert((uintptr_t)line % 64 == 0);
+    my_assert((uintptr_t)page % 4096 == 0);
+    my_assert(padding == odd + 32); // The gap in front of the cache line aligned block is not wasted
+    my_assert(mem_alloc_aligned(16, 48) == NULL);
+    my_assert(mem_alloc_aligned(SIZE_MAX, 64) == NULL);
+    my_assert(mem_alloc_aligned(SIZE_MAX - 15, 4096) == NULL); // A whole number of granules, padded it wraps
+    my_assert(mem_alloc_aligned(64, SIZE_MAX / 2 + 1) == NULL);
+
+    memset(page, 0x77, 4096);
+    sanityCheck(4096, page, 0x77);
+
+    mem_free(odd);
+    mem_free(line);
+    mem_free(page);
+    mem_free(padding);
+
+    void *whole = mem_alloc(16384);
+    my_assert(whole != NULL);
+    mem_free(whole);
+
+    mem_deinit();
+    printf_green("[PASS].\n");
+}
+
+/*
+ * This function checks that mem_resize grows a block into the free space after it and shrinks it where it is,
+ * and only moves it (keeping its contents) when the next block is taken.
+ * Blocks are larger than the thread caches hold, so every free goes straight back to the pool.
+ */
+void test_resize_in_place()
+{
+    printf_yellow("  Testing \"mem_resize in place\" ---> ");
+    mem_init(2048);
+
+    char *block = (char *)mem_alloc(300);
+    my_assert(block != NULL);
+    memset(block, 0x3C, 300);
+
+    my_assert(mem_resize(block, 600) == block); // Grows into the free tail of the pool
+    sanityCheck(300, block, 0x3C);
+    my_assert(mem_resize(block, 300) == block); // Gives the tail back
+
+    char *next = (char *)mem_alloc(400);
+    my_assert(next == block + 304); // The freed tail is reused right after the block
+
+    char *moved = (char *)mem_resize(block, 500); // No room after the block any more
+    my_assert(moved != NULL && moved != block);
+    sanityCheck(300, moved, 0x3C);
+
+    mem_free(next);
+    mem_free(moved);
+
+    void *whole = mem_alloc(2048);
+    my_assert(whole != NULL);
+    mem_free(whole);
+
+    mem_deinit();
+    printf_green("[PASS].\n");
+}
+
+/*
+ * This function is used to test the shared free lists of small blocks. Each thread frees more small blocks than its
+ * own cache holds, so the overflow is shared with the other threads, which pick it up while allocating.
+ * The test passes if no allocation fails and the whole pool can be allocated as one block afterwards.
+ */
+void *thread_small_overflow(void *arg)
+{
+    thread_data_t *data = (thread_data_t *)arg;
+    void *blocks[100];
+
+    for (int i = 0; i < data->iterations; i++)
+    {
+        for (int j = 0; j < 100; j++)
+        {
+            blocks[j] = mem_alloc(data->block_size);
+            my_assert(blocks[j] != NULL);
+            memset(blocks[j], data->thread_id, data->block_size);
+        }
+        for (int j = 0; j < 100; j++)
+        {
+            sanityCheck(data->block_size, blocks[j], data->thread_id);
+            mem_free(blocks[j]);
+        }
+    }
+
+    return NULL;
+}
+
+void test_shared_free_lists_multithread(TestParams params)
+{
+    printf_yellow("  Testing \"shared free lists\" (threads: %d) ---> ", params.num_threads);
+
+    size_t block_size = 32;
+    size_t memory_size = params.num_threads * 100 * block_size;
+    pthread_t threads[params.num_threads];
+    thread_data_t params_t[params.num_threads];
+
+    mem_init(memory_size);
+
+    for (int i = 0; i < params.num_threads; i++)
+    {
+        params_t[i].thread_id = i;
+        params_t[i].block_size = block_size;
+        params_t[i].iterations = params.iterations;
+        if (pthread_create(&threads[i], NULL, thread_small_overflow, &params_t[i]) != 0)
+        {
+            perror("Failed to create thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (int i = 0; i < params.num_threads; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    void *whole = mem_alloc(memory_size);
+    mem_free(whole);
+    mem_deinit();
+
+    if (whole != NULL)
+    {
+        printf_green("[PASS].\n");
+    }
+    else
+    {
+        printf_red("[FAIL]: Blocks were left behind on the shared free lists.\n");
+    }
+}
+
+/*
+ * This function checks the buddy backend: blocks are powers of two placed next to their buddy, a block grows in place
+ * while its buddy is free and shrinks by freeing upper halves, and freed buddies merge back into the whole pool.
+ * Blocks are larger than the thread caches hold, so every free goes straight back to the pool.
+ */
+void test_buddy_backend()
+{
+    printf_yellow("  Testing \"buddy backend\" ---> ");
+    mem_init_with(4096, &(mem_options_t){.backend = MEM_BACKEND_BUDDY});
+
+    char *first = (char *)mem_alloc(300);  // Rounded up to 512 bytes
+    char *second = (char *)mem_alloc(400); // Its buddy
+    my_assert(first != NULL && second == first + 512);
+    mem_free(second);
+
+    memset(first, 0x5B, 300);
+    my_assert(mem_resize(first, 1000) == first); // Absorbs the free buddy
+    sanityCheck(300, first, 0x5B);
+    my_assert(mem_resize(first, 300) == first); // Gives the upper half back
+    second = (char *)mem_alloc(512);
+    my_assert(second == first + 512);
+
+    char *moved = (char *)mem_resize(first, 1000); // The buddy is taken now
+    my_assert(moved != NULL && moved != first);
+    sanityCheck(300, moved, 0x5B);
+
+    mem_free(second);
+    mem_free(moved);
+
+    void *whole = mem_alloc(4096);
+    my_assert(whole != NULL);
+    mem_free(whole);
+    mem_deinit();
+
+    // A pool that is not a power of two is covered by several top-level blocks
+    mem_init_with(3072, &(mem_options_t){.backend = MEM_BACKEND_BUDDY});
+    char *large = (char *)mem_alloc(2048);
+    char *small = (char *)mem_alloc(1024);
+    my_assert(large != NULL && small == large + 2048);
+    mem_free(large);
+    mem_free(small);
+    mem_deinit();
+
+    printf_green("[PASS].\n");
+}
+
+/*
+ * This function checks deferred coalescing: a freed block is handed out again as it is, a double free of a deferred
+ * block is still caught, and the deferred blocks are merged once the pool runs out of space.
+ * Blocks are larger than the thread caches hold, so every free goes straight back to the pool.
+ */
+void test_deferred_coalescing()
+{
+    printf_yellow("  Testing \"deferred coalescing\" ---> ");
+    mem_init_with(2048, &(mem_options_t){.defer_limit = 8});
+
+    char *first = (char *)mem_alloc(512);
+    char *second = (char *)mem_alloc(512);
+    my_assert(first != NULL && second != NULL);
+
+    mem_free(first);
+    mem_free(first); // Double free while the block waits to be merged
+    my_assert(mem_alloc(512) == first);
+
+    mem_free(first);
+    mem_free(second);
+
+    void *whole = mem_alloc(2048); // Only fits once the deferred blocks are merged
+    my_assert(whole != NULL);
+    mem_free(whole);
+
+    mem_deinit();
+    printf_green("[PASS].\n");
+}
+
+/*
+ * This function checks mem_alloc_many and mem_free_many: a batch is carved out of one contiguous run when there is
+ * room, a batch that does not fit allocates nothing, and freeing in any order merges the pool back together.
+ */
+void test_batch_alloc_and_free()
+{
+    printf_yellow("  Testing \"mem_alloc_many and mem_free_many\" ---> ");
+    mem_init(4096);
+
+    void *blocks[64];
+    my_assert(mem_alloc_many(48, 64, blocks) == 64);
+    for (int i = 1; i < 64; i++)
+    {
+        my_assert((char *)blocks[i] == (char *)blocks[i - 1] + 48); // One contiguous run
+    }
+    for (int i = 0; i < 64; i++)
+    {
+        memset(blocks[i], i, 48);
+    }
+    for (int i = 0; i < 64; i++)
+    {
+        sanityCheck(48, blocks[i], i);
+    }
+
+    void *more[32];
+    my_assert(mem_alloc_many(48, 32, more) == 0); // Only 1024 bytes are left
+
+    // The blocks the failed batch got before running out were never counted, so freeing them is not counted either
+    mem_stats_t stats = mem_stats();
+    my_assert(stats.allocs == 64 && stats.frees == 0);
+    my_assert(stats.live_bytes == 64 * 48);
+
+    // Free in reverse order, the batch sorts them
+    for (int i = 0; i < 32; i++)
+    {
+        void *swap = blocks[i];
+        blocks[i] = blocks[63 - i];
+        blocks[63 - i] = swap;
+    }
+    mem_free_many(blocks, 64);
+    stats = mem_stats();
+    my_assert(stats.frees == 64 && stats.live_bytes == 0);
+
+    void *whole = mem_alloc(4096);
+    my_assert(whole != NULL);
+    mem_free(whole);
+
+    mem_deinit();
+    printf_green("[PASS].\n");
+}
+
+/*
+ * This function checks pools backed by an anonymous mapping, transparent huge pages and explicit huge pages:
+ * blocks far apart are committed on first use, resizing keeps the data, and the whole pool is usable at the end.
+ */
+void test_mapped_pools()
+{
+    printf_yellow("  Testing mmap-backed pools ---> ");
+    mem_pages_t kinds[] = {MEM_PAGES_MMAP, MEM_PAGES_HUGE, MEM_PAGES_HUGETLB};
+    for (int k = 0; k < 3; k++)
+    {
+        mem_options_t options = {.arenas = 1, .pages = kinds[k]};
+        size_t size = 8 * 1024 * 1024;
+        mem_init_with(size, &options);
+
+        // Blocks far apart are committed on first use
+        char *first = mem_alloc(1024 * 1024);
+        char *second = mem_alloc(3 * 1024 * 1024);
+        my_assert(first != NULL && second != NULL);
+        memset(first, 0xA1, 1024 * 1024);
+        memset(second, 0xB2, 3 * 1024 * 1024);
+        char *grown = mem_resize(first, 2 * 1024 * 1024);
+        my_assert(grown != NULL);
+        memset(grown, 0xC3, 2 * 1024 * 1024);
+        my_assert((unsigned char)second[3 * 1024 * 1024 - 1] == 0xB2);
+        mem_free(grown);
+        mem_free(second);
+
+        // The whole pool is still one block, and all of it is usable
+        char *whole = mem_alloc(size);
+        my_assert(whole != NULL);
+        memset(whole, 0xD4, size);
+        mem_free(whole);
+
+        mem_deinit();
+    }
+    printf_green("[PASS].\n");
+}
+
+/*
+ * This function checks mem_trim: the pages of a free pool go back to the system only once, are no longer resident,
+ * and pages used again are given back again once they are free. The free pages of a pool file leave the file.
+ */
+void test_trim()
+{
+    printf_yellow("  Testing mem_trim ---> ");
+    size_t size = 1024 * 1024;
+    long page = sysconf(_SC_PAGESIZE);
+    unsigned char resident[256]; // One per page, pages are at least 4 KiB
+    mem_init(size);
+
+    char *block = mem_alloc(size);
+    my_assert(block != NULL);
+    memset(block, 0x5A, size);
+    mem_free(block);
+
+    // Nearly all of the free pool goes back, and only once
+    size_t released = mem_trim();
+    my_assert(released >= size - 2 * page);
+    my_assert(mem_trim() == 0);
+    size_t pages = size / page;
+    my_assert(mincore(block, pages * page, resident) == 0);
+    for (size_t i = 0; i < pages; i++)
+    {
+        my_assert(!(resident[i] & 1));
+    }
+
+    // Pages used again are trimmed again
+    char *half = mem_alloc(size / 2);
+    my_assert(half == block);
+    memset(half, 0x6B, size / 2);
+    my_assert(mem_trim() == 0); // The rest was trimmed already
+    mem_free(half);
+    my_assert(mem_trim() >= size / 2);
+    mem_deinit();
+
+    // The pages of a pool file stay in the file unless they are punched out of it
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/test_memory_manager_%d_trim.pool", (int)getpid());
+    unlink(path);
+    mem_options_t options = {.file = path};
+    mem_init_with(size, &options);
+    block = mem_alloc(size);
+    my_assert(block != NULL);
+    memset(block, 0x5A, size);
+    mem_free(block);
+    struct stat before, after;
+    my_assert(stat(path, &before) == 0);
+    released = mem_trim();
+    my_assert(stat(path, &after) == 0);
+    my_assert((size_t)(before.st_blocks - after.st_blocks) * 512 >= released); // Nothing is released where holes cannot be punched
+    mem_deinit();
+    unlink(path);
+
+    printf_green("[PASS].\n");
+}
+
+/*
+ * This function checks a pool that grows: it takes chunks as it fills without moving the blocks it has, stops at
+ * max_size, and gives free chunks back so it can grow again.
+ */
+void test_growable_pool()
+{
+    printf_yellow("  Testing growable pools ---> ");
+    mem_options_t options = {.arenas = 2, .max_size = 64 * 1024};
+    mem_init_with(4096, &options);
+
+    // The pool starts small and grows as it fills
+    void *blocks[40];
+    for (int i = 0; i < 40; i++)
+    {
+        blocks[i] = mem_alloc(1000);
+        my_assert(blocks[i] != NULL);
+        memset(blocks[i], i, 1000);
+    }
+    char *large = mem_alloc(8192);
+    my_assert(large != NULL);
+    memset(large, 0xEE, 8192);
+    for (int i = 0; i < 40; i++)
+    {
+        sanityCheck(1000, blocks[i], i);
+    }
+
+    // But not past its cap
+    my_assert(mem_alloc(64 * 1024) == NULL);
+
+    // Chunks go back once they are free, and the pool can grow again
+    mem_free(large);
+    for (int i = 0; i < 40; i++)
+    {
+        mem_free(blocks[i]);
+    }
+    mem_trim();
+    my_assert(mem_alloc_many(1000, 40, blocks) == 40);
+    mem_free_many(blocks, 40);
+    void *whole = mem_alloc(4096);
+    my_assert(whole != NULL);
+    mem_free(whole);
+
+    mem_deinit();
+    printf_green("[PASS].\n");
+}
+
+/*
+ * This function checks a pool kept in a file: a chain of blocks left in the root is back as it was after reopening,
+ * reopening while the pool's address is taken moves the pool and its root, two pool files can be open at once,
+ * a file that cannot be opened is reported instead of exiting, and the reopened pool carries on allocating.
+ */
+void test_persistent_pool()
+{
+    printf_yellow("  Testing persistent pools ---> ");
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/test_memory_manager_%d.pool", (int)getpid());
+    unlink(path);
+    mem_options_t options = {.file = path};
+
+    // Build a chain of blocks and leave its start in the root
+    mem_init_with(64 * 1024, &options);
+    my_assert(mem_root() == NULL);
+    void **chain = NULL;
+    for (int i = 0; i < 100; i++)
+    {
+        void **link = mem_alloc(64);
+        my_assert(link != NULL);
+        link[0] = chain;
+        memset(link + 1, i, 64 - sizeof(void *));
+        chain = link;
+    }
+    mem_set_root(chain);
+    mem_deinit();
+
+    // While something else is mapped where the pool was, it opens elsewhere: the root comes along, the links in
+    // the blocks are moved by the program
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    void *taken = (void *)((uintptr_t)chain & ~(uintptr_t)(page - 1));
+    my_assert(mmap(taken, page, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) == taken);
+    my_assert(mem_init_with(0, &options) == 0);
+    void **moved = mem_root();
+    my_assert(moved != chain && (char *)moved - (char *)chain == mem_moved());
+    int links = 0;
+    for (void **link = moved; link != NULL; link = link[0])
+    {
+        sanityCheck(64 - sizeof(void *), (char *)(link + 1), 99 - links);
+        if (link[0] != NULL)
+        {
+            link[0] = (char *)link[0] + mem_moved();
+        }
+        links++;
+    }
+    my_assert(links == 100);
+    mem_deinit();
+    munmap(taken, page);
+
+    // Reopened, the chain is where it was moved to and the pool carries on
+    my_assert(mem_init_with(0, &options) == 0);
+    chain = mem_root();
+    my_assert(chain == moved && mem_moved() == 0);
+    links = 0;
+    for (void **link = chain; link != NULL; link = link[0])
+    {
+        sanityCheck(64 - sizeof(void *), (char *)(link + 1), 99 - links);
+        links++;
+    }
+    my_assert(links == 100);
+    while (chain != NULL)
+    {
+        void **next = chain[0];
+        mem_free(chain);
+        chain = next;
+    }
+    void *whole = mem_alloc(64 * 1024);
+    my_assert(whole != NULL);
+    mem_free(whole);
+    mem_deinit();
+
+    // Every file has an address of its own, so two can be open at the same time, and again after reopening
+    char other_path[64];
+    snprintf(other_path, sizeof(other_path), "/tmp/test_memory_manager_%d_other.pool", (int)getpid());
+    unlink(other_path);
+    mem_options_t other_options = {.file = other_path};
+    for (int round = 0; round < 2; round++)
+    {
+        mem_pool_t *first = mem_pool_create_with(4096, &options);
+        mem_pool_t *second = mem_pool_create_with(4096, &other_options);
+        my_assert(first != NULL && second != NULL);
+        my_assert(mem_pool_moved(first) == 0 && mem_pool_moved(second) == 0);
+        char *a = round == 0 ? mem_pool_alloc(first, 64) : mem_pool_root(first);
+        char *b = round == 0 ? mem_pool_alloc(second, 64) : mem_pool_root(second);
+        my_assert(a != NULL && b != NULL);
+        if (round == 0)
+        {
+            memset(a, 0xA1, 64);
+            memset(b, 0xB2, 64);
+            mem_pool_set_root(first, a);
+            mem_pool_set_root(second, b);
+        }
+        sanityCheck(64, a, 0xA1);
+        sanityCheck(64, b, 0xB2);
+        mem_pool_destroy(first);
+        mem_pool_destroy(second);
+    }
+    unlink(other_path);
+
+    // A file that cannot be opened is an error for the caller, not the end of the program
+    mem_options_t missing_options = {.file = "/nonexistent/test_memory_manager.pool", .quiet = 1};
+    my_assert(mem_init_with(4096, &missing_options) == -1);
+
+    unlink(path);
+    printf_green("[PASS].\n");
+}
+
+/*
+ * This function checks mem_stats: block and byte counts, the largest free block and the fragmentation it gives,
+ * and the call counters with the live and peak bytes.
+ */
+void test_stats()
+{
+    printf_yellow("  Testing mem_stats ---> ");
+    mem_init(4096);
+
+    // A hole between two blocks splits the free memory
+    void *a = mem_alloc(512);
+    void *b = mem_alloc(512);
+    void *c = mem_alloc(512);
+    mem_free(b);
+    mem_stats_t stats = mem_stats();
+    my_assert(stats.size == 4096);
+    my_assert(stats.used_blocks == 2 && stats.used_bytes == 1024);
+    my_assert(stats.free_blocks == 2 && stats.free_bytes == 3072);
+    my_assert(stats.largest_free == 2560);
+    my_assert(fabs(stats.fragmentation - 512.0 / 3072.0) < 1e-9);
+    my_assert(stats.allocs == 3 && stats.frees == 1 && stats.resizes == 0);
+    my_assert(stats.live_bytes == 1024 && stats.peak_bytes == 1536);
+
+    // Growing into the hole fills it
+    my_assert(mem_resize(a, 1024) == a);
+    stats = mem_stats();
+    my_assert(stats.resizes == 1 && stats.live_bytes == 1536);
+    my_assert(stats.free_blocks == 1 && stats.fragmentation == 0.0);
+
+    mem_free(a);
+    mem_free(c);
+    stats = mem_stats();
+    my_assert(stats.used_blocks == 0 && stats.free_bytes == 4096 && stats.largest_free == 4096);
+    my_assert(stats.live_bytes == 0 && stats.peak_bytes == 1536);
+    mem_deinit();
+
+    // Fragmentation is measured within each arena, free arenas side by side are not fragmented
+    mem_options_t options = {.arenas = 4};
+    mem_init_with(4096, &options);
+    stats = mem_stats();
+    my_assert(stats.free_blocks == 4 && stats.largest_free == 1024 && stats.fragmentation == 0.0);
+    void *d = mem_alloc(320); // Past the thread cache, so freeing it leaves a hole
+    void *e = mem_alloc(320);
+    void *f = mem_alloc(320);
+    mem_free(e);
+    stats = mem_stats();
+    my_assert(stats.free_bytes == 3456 && stats.largest_free == 1024);
+    my_assert(fabs(stats.fragmentation - 64.0 / 3456.0) < 1e-9); // The home arena's 64-byte tail is off its 320-byte hole
+    mem_free(d);
+    mem_free(f);
+
+    mem_deinit();
+    printf_green("[PASS].\n");
+}
+
+/*
+ * This function checks mem_profile: the histogram buckets, and that a library built with -DMM_PROFILE times every
+ * call and lock while one built without it counts nothing.
+ */
+void test_profile()
+{
+    printf_yellow("  Testing mem_profile ---> ");
+    my_assert(mem_profile_bucket_floor(0) == 0 && mem_profile_bucket_floor(3) == 3);
+    my_assert(mem_profile_bucket_floor(4) == 4 && mem_profile_bucket_floor(7) == 7);
+    my_assert(mem_profile_bucket_floor(8) == 8 && mem_profile_bucket_floor(9) == 10);
+    my_assert(mem_profile_bucket_floor(12) == 16);
+
+    mem_profile_reset();
+    mem_init(4096);
+    void *a = mem_alloc(512);
+    void *b = mem_alloc(512);
+    a = mem_resize(a, 1024);
+    mem_free(a);
+    mem_free(b);
+    mem_deinit();
+
+    mem_profile_t profile;
+    if (mem_profile(&profile))
+    {
+        unsigned long long calls[MEM_OPS] = {0};
+        unsigned long long searches = 0, holds = 0;
+        for (int i = 0; i < MEM_PROFILE_BUCKETS; i++)
+        {
+            for (int op = 0; op < MEM_OPS; op++)
+            {
+                calls[op] += profile.latency[op][i];
+            }
+            searches += profile.scanned[i];
+            holds += profile.lock_hold[i];
+        }
+        my_assert(calls[MEM_OP_ALLOC] >= 2 && calls[MEM_OP_FREE] >= 2 && calls[MEM_OP_RESIZE] >= 1);
+        my_assert(searches >= 2);
+        my_assert(profile.lock_acquires > 0 && holds == profile.lock_acquires);
+        my_assert(profile.lock_waits <= profile.lock_acquires);
+    }
+    else
+    {
+        // Compiled out: nothing is counted
+        my_assert(profile.lock_acquires == 0 && profile.latency[MEM_OP_ALLOC][0] == 0);
+    }
+    printf_green("[PASS].\n");
+}
+
+/*
+ * This function checks mem_usable_size: at least the requested size for a block, 0 for anything else, and a quiet
+ * pool failing without printing.
+ */
+void test_usable_size()
+{
+    printf_yellow("  Testing mem_usable_size ---> ");
+    mem_init(4096);
+    void *a = mem_alloc(100);
+    my_assert(mem_usable_size(a) >= 100 && mem_usable_size(a) % 16 == 0);
+    my_assert(mem_usable_size((char *)a + 16) == 0);
+    int outside;
+    my_assert(mem_usable_size(&outside) == 0);
+    mem_free(a);
+    my_assert(mem_usable_size(a) == 0);
+    mem_deinit();
+
+    // A quiet pool fails the same way, without a word
+    mem_options_t options = {.quiet = 1};
+    mem_pool_t *pool = mem_pool_create_with(4096, &options);
+    my_assert(mem_pool_alloc(pool, 8192) == NULL);
+    mem_pool_free(pool, &outside);
+    mem_pool_destroy(pool);
+    printf_green("[PASS].\n");
+}
+
 /* repeated from A1, as there were solutions that has issues */
 
 void test_looking_for_out_of_bounds()
@@ -936,6 +1865,25 @@ int main(int argc, char *argv[])
         test_memory_fragmentation_multithread((TestParams){.num_threads = base_num_threads, .memory_size = 2048});
         test_random_blocks_multithread((TestParams){.num_threads = base_num_threads, .block_size = 1024});
 
+        test_invalid_and_double_free();
+        test_thread_cache_drain_multithread((TestParams){.num_threads = base_num_threads, .iterations = 100});
+        test_independent_pools();
+        test_slab_alloc_and_free();
+        test_fit_policies();
+        test_aligned_alloc();
+        test_resize_in_place();
+        test_shared_free_lists_multithread((TestParams){.num_threads = base_num_threads, .iterations = 100});
+        test_buddy_backend();
+        test_deferred_coalescing();
+        test_batch_alloc_and_free();
+        test_mapped_pools();
+        test_trim();
+        test_growable_pool();
+        test_persistent_pool();
+        test_stats();
+        test_profile();
+        test_usable_size();
+
         break;
 
     case 1:
@@ -978,6 +1926,29 @@ int main(int argc, char *argv[])
         printf("Testing large number of blocks of fixed size\n");
         for (int i = 0; i < 9; i++)
             run_concurrency_test((TestParams){.num_threads = pow(2, i), .num_blocks = allocs, .block_size = blockSize, .simulate_work = simulate_work});
+
+        printf("Testing large number of blocks of fixed size, one arena per thread\n");
+        for (int i = 0; i < 9; i++)
+            run_concurrency_test((TestParams){.num_threads = pow(2, i), .num_blocks = allocs, .block_size = blockSize, .simulate_work = simulate_work, .arenas = pow(2, i)});
+
+        printf("Testing large number of blocks of fixed size, batched\n");
+        for (int i = 0; i < 9; i++)
+            run_concurrency_test((TestParams){.num_threads = pow(2, i), .num_blocks = allocs, .block_size = blockSize, .simulate_work = simulate_work, .batched = true});
+
+        printf("Testing large number of blocks of fixed size, buddy backend\n");
+        for (int i = 0; i < 9; i++)
+            run_concurrency_test((TestParams){.num_threads = pow(2, i), .num_blocks = allocs, .block_size = blockSize, .simulate_work = simulate_work, .backend = MEM_BACKEND_BUDDY});
+
+        printf("Comparing immediate and deferred coalescing\n");
+        for (int defer = 0; defer <= 64; defer += 64)
+            test_repeated_fit_reuse_multithread((TestParams){.num_threads = 8, .memory_size = 8192, .iterations = 100000, .defer_limit = defer});
+
+        printf("Comparing placement policies\n");
+        for (int fit = MEM_FIT_SEGREGATED; fit <= MEM_FIT_BITMAP; fit++)
+        {
+            test_memory_fragmentation_multithread((TestParams){.num_threads = 8, .memory_size = 2048, .iterations = 1000, .fit = fit});
+            test_memory_overcommit_multithread((TestParams){.num_threads = 8, .memory_size = 1024, .fit = fit});
+        }
         break;
 
     case 3:
@@ -990,4 +1961,4 @@ int main(int argc, char *argv[])
         break;
     }
     return 0;
-}
\ No newline at end of file
+}
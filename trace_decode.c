@@ -0,0 +1,96 @@
+/*Petter Eriksson, 2024-10-04, git: Milloz-dev*, peer22@student.bth.se*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "malloc_trace.h"
+
+/*Trace decoder
+*
+*Prints a trace recorded by the cM2.c interposer, one call per line, as text or (with -c) as CSV.
+*Times are in nanoseconds since tracing started, the text shows when each call returned (when it was made for free).
+*/
+static const char* op_names[TRACE_OPS] = {"malloc", "free", "calloc", "realloc", "memalign", "mmap", "munmap"};
+
+static void print_text(const trace_record_t* record, uint64_t start) {
+    printf("%12llu %7u ", (unsigned long long)(record->timestamp - start), record->thread);
+    unsigned long long ptr = (unsigned long long)record->ptr;
+    unsigned long long size = (unsigned long long)record->size;
+    unsigned long long arg = (unsigned long long)record->arg;
+    switch (record->op) {
+    case TRACE_MALLOC:
+        printf("malloc(%llu) = %#llx\n", size, ptr);
+        break;
+    case TRACE_FREE:
+        printf("free(%#llx)\n", ptr);
+        break;
+    case TRACE_CALLOC:
+        printf("calloc(%llu, %llu) = %#llx\n", arg, arg != 0 ? size / arg : 0, ptr);
+        break;
+    case TRACE_REALLOC:
+        printf("realloc(%#llx, %llu) = %#llx\n", arg, size, ptr);
+        break;
+    case TRACE_MEMALIGN:
+        printf("memalign(%llu, %llu) = %#llx\n", arg, size, ptr);
+        break;
+    case TRACE_MMAP:
+        printf("mmap(%llu) = %#llx\n", size, ptr);
+        break;
+    case TRACE_MUNMAP:
+        printf("munmap(%#llx, %llu) = %lld\n", ptr, size, (long long)record->arg);
+        break;
+    default:
+        printf("unknown op %u\n", record->op);
+        break;
+    }
+}
+
+static void print_csv(const trace_record_t* record, uint64_t start) {
+    const char* name = record->op < TRACE_OPS ? op_names[record->op] : "unknown";
+    printf("%llu,%llu,%u,%s,%llu,%#llx,%llu\n", (unsigned long long)(record->timestamp - start),
+           (unsigned long long)(record->start - start), record->thread, name, (unsigned long long)record->size,
+           (unsigned long long)record->ptr, (unsigned long long)record->arg);
+}
+
+int main(int argc, char* argv[]) {
+    int csv = argc == 3 && strcmp(argv[1], "-c") == 0;
+    if (argc != 2 + csv) {
+        fprintf(stderr, "Usage: %s [-c] <trace file>\n", argv[0]);
+        return 1;
+    }
+
+    FILE* file = fopen(argv[1 + csv], "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Error: Could not open %s.\n", argv[1 + csv]);
+        return 1;
+    }
+    trace_header_t header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0) {
+        fprintf(stderr, "Error: %s is not a trace file.\n", argv[1 + csv]);
+        fclose(file);
+        return 1;
+    }
+    if (header.record_size != sizeof(trace_record_t)) {
+        fprintf(stderr, "Error: Records of %u bytes, expected %zu.\n", header.record_size, sizeof(trace_record_t));
+        fclose(file);
+        return 1;
+    }
+
+    if (csv) {
+        printf("time_ns,start_ns,thread,op,size,ptr,arg\n");
+    } else {
+        printf("# pid %u\n", header.pid);
+    }
+    trace_record_t records[1024];
+    size_t count;
+    while ((count = fread(records, sizeof(trace_record_t), 1024, file)) > 0) {
+        for (size_t i = 0; i < count; i++) {
+            if (csv) {
+                print_csv(&records[i], header.start);
+            } else {
+                print_text(&records[i], header.start);
+            }
+        }
+    }
+    fclose(file);
+    return 0;
+}
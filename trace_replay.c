@@ -0,0 +1,508 @@
+/*Petter Eriksson, 2024-10-04, git: Milloz-dev*, peer22@student.bth.se*/
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include "memory_manager.h"
+#include "malloc_trace.h"
+#include "mem_histogram.h"
+
+/*Trace replay
+*
+*Replays an allocation trace recorded by the cM2.c interposer through mem_alloc, mem_free and mem_resize, then
+*reports throughput, latency percentiles, peak pool usage and fragmentation. mmap and munmap are left out.
+*
+*Every thread of the trace is replayed in its own order by one of the replay threads (-t). A block one thread frees
+*or resizes after another allocated it waits for that allocation, so the replay follows the recorded order across
+*threads wherever it matters. Frees of blocks the trace never shows being allocated (before tracing started, or
+*through calls the tracer does not wrap) are skipped and counted. So are blocks allocated again at an address that is
+*still live: its free is missing from the trace, so the replay frees the earlier block just before.
+*/
+#define REPLAY_SAMPLE_NS 10000000  // How often the pool is sampled for its usage and fragmentation
+
+typedef enum {
+    REPLAY_ALLOC,
+    REPLAY_FREE,
+    REPLAY_RESIZE,
+    REPLAY_OPS
+} replay_op_t;
+
+static const char* replay_op_names[REPLAY_OPS] = {"alloc", "free", "resize"};
+
+// One call to make, blocks are referred to by slot: the allocation that made them
+typedef struct {
+    replay_op_t op;
+    size_t size;            // Bytes to allocate or resize to
+    size_t alignment;       // For memalign, otherwise 0
+    int zero;               // For calloc: clear the block like calloc would
+    long freed;             // Slot of the block freed or resized, -1 if none
+    long made;              // Slot of the block allocated or resized to, -1 if none
+} ReplayOp;
+
+// The calls of one replay thread
+typedef struct {
+    ReplayOp* ops;
+    size_t count;
+    size_t capacity;
+    unsigned long long latency[REPLAY_OPS][MEM_PROFILE_BUCKETS];  // Calls per bucket of nanoseconds
+    unsigned long long failed;                                     // Allocations the pool could not serve
+    pthread_t thread;
+} ReplayThread;
+
+static void** slots;            // Block made by each allocation, NULL until it is made
+static char failed_block;       // Stands in for a block the pool could not serve
+static int replay_finished = 0; // Replay threads that are done
+
+static void* checked_realloc(void* block, size_t size) {
+    void* grown = realloc(block, size);
+    if (grown == NULL) {
+        fprintf(stderr, "Error: Out of memory reading the trace.\n");
+        exit(1);
+    }
+    return grown;
+}
+
+/*Pointer table
+*
+*Maps the addresses the traced program got back to the slot of the allocation that returned them, while they are
+*live. Open addressing with linear probing; deletion shifts the entries after it back, so no tombstones are needed.
+*/
+typedef struct {
+    uint64_t* keys;         // Address, 0 for an empty entry
+    long* values;           // Slot
+    size_t mask;            // Entries - 1, entries are a power of two
+} PointerTable;
+
+static size_t table_home(PointerTable* table, uint64_t key) {
+    return (size_t)((key >> 4) * 0x9E3779B97F4A7C15ULL) & table->mask;
+}
+
+// Map key to value. Returns the slot key was mapped to before, or -1 if it was not there.
+static long table_put(PointerTable* table, uint64_t key, long value) {
+    size_t i = table_home(table, key);
+    while (table->keys[i] != 0 && table->keys[i] != key) {
+        i = (i + 1) & table->mask;
+    }
+    long previous = table->keys[i] == key ? table->values[i] : -1;
+    table->keys[i] = key;
+    table->values[i] = value;
+    return previous;
+}
+
+// Remove key and return its slot, or -1 if it is not there
+static long table_take(PointerTable* table, uint64_t key) {
+    size_t i = table_home(table, key);
+    while (table->keys[i] != key) {
+        if (table->keys[i] == 0) {
+            return -1;
+        }
+        i = (i + 1) & table->mask;
+    }
+    long value = table->values[i];
+
+    // Move back every entry of the run after i that may sit in the hole
+    size_t hole = i;
+    for (size_t j = (i + 1) & table->mask; table->keys[j] != 0; j = (j + 1) & table->mask) {
+        size_t home = table_home(table, table->keys[j]);
+        if (((j - home) & table->mask) >= ((j - hole) & table->mask)) {
+            table->keys[hole] = table->keys[j];
+            table->values[hole] = table->values[j];
+            hole = j;
+        }
+    }
+    table->keys[hole] = 0;
+    return value;
+}
+
+/*Loading
+*
+*Reads the whole trace, sorts it by time (keeping the file order of equal times) and turns it into the calls of each
+*replay thread. A realloc gives its old block up when it starts and gets the new one when it returns, so it is sorted
+*in twice, see malloc_trace.h. Traced threads are dealt out to the replay threads in the order they first show up.
+*/
+static trace_record_t* trace_records;
+
+// A record at the time it gets its block, or (release) a realloc at the time it gives its old one up
+typedef struct {
+    trace_record_t* record;
+    int release;
+} TraceEvent;
+
+static uint64_t event_time(const TraceEvent* event) {
+    return event->release ? event->record->start : event->record->timestamp;
+}
+
+static int event_order(const void* a, const void* b) {
+    const TraceEvent* first = (const TraceEvent*)a;
+    const TraceEvent* second = (const TraceEvent*)b;
+    if (event_time(first) != event_time(second)) {
+        return event_time(first) < event_time(second) ? -1 : 1;
+    }
+    if (first->record != second->record) {
+        return first->record < second->record ? -1 : 1;
+    }
+    return second->release - first->release;
+}
+
+static void add_op(ReplayThread* thread, ReplayOp op) {
+    if (thread->count == thread->capacity) {
+        thread->capacity = thread->capacity == 0 ? 1024 : thread->capacity * 2;
+        thread->ops = (ReplayOp*)checked_realloc(thread->ops, thread->capacity * sizeof(ReplayOp));
+    }
+    thread->ops[thread->count++] = op;
+}
+
+typedef struct {
+    size_t records;             // Records in the trace
+    size_t ops;                 // Calls to replay
+    size_t traced_threads;      // Threads in the trace
+    size_t unknown;             // Frees and resizes of blocks not in the trace, skipped
+    size_t reused;              // Addresses allocated again while live, the earlier block freed by the replay
+    size_t peak_bytes;          // Most bytes the traced program had allocated at once
+} TraceSummary;
+
+static size_t load_trace(const char* path, ReplayThread* threads, int thread_count, TraceSummary* summary) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Error: Could not open %s.\n", path);
+        exit(1);
+    }
+    trace_header_t header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.record_size != sizeof(trace_record_t)) {
+        fprintf(stderr, "Error: %s is not a trace file of this build.\n", path);
+        exit(1);
+    }
+    size_t count = 0;
+    size_t capacity = 0;
+    for (;;) {
+        if (count == capacity) {
+            capacity = capacity == 0 ? 65536 : capacity * 2;
+            trace_records = (trace_record_t*)checked_realloc(trace_records, capacity * sizeof(trace_record_t));
+        }
+        size_t read = fread(trace_records + count, sizeof(trace_record_t), capacity - count, file);
+        if (read == 0) {
+            break;
+        }
+        count += read;
+    }
+    fclose(file);
+    summary->records = count;
+
+    size_t events = 0;
+    TraceEvent* order = (TraceEvent*)checked_realloc(NULL, (2 * count + 1) * sizeof(TraceEvent));
+    for (size_t i = 0; i < count; i++) {
+        if (trace_records[i].op == TRACE_REALLOC && trace_records[i].arg != 0) {
+            order[events++] = (TraceEvent){&trace_records[i], 1};
+        }
+        order[events++] = (TraceEvent){&trace_records[i], 0};
+    }
+    qsort(order, events, sizeof(TraceEvent), event_order);
+    long* released = (long*)checked_realloc(NULL, (count + 1) * sizeof(long));  // Slot each realloc gave up, by record
+
+    // Room for every block to be live at once at no more than half load
+    PointerTable table;
+    size_t entries = 16;
+    while (entries < 2 * count) {
+        entries *= 2;
+    }
+    table.keys = (uint64_t*)calloc(entries, sizeof(uint64_t));
+    table.values = (long*)calloc(entries, sizeof(long));
+    size_t* sizes = (size_t*)checked_realloc(NULL, (count + 1) * sizeof(size_t));  // Bytes of each slot, for the peak
+    if (table.keys == NULL || table.values == NULL) {
+        fprintf(stderr, "Error: Out of memory reading the trace.\n");
+        exit(1);
+    }
+    table.mask = entries - 1;
+
+    uint32_t* traced = NULL;  // Kernel ids of the traced threads, in the order they showed up
+    long slot_count = 0;
+    size_t live = 0;
+    for (size_t i = 0; i < events; i++) {
+        trace_record_t* record = order[i].record;
+        if (order[i].release) {
+            long freed = table_take(&table, record->arg);
+            if (freed >= 0) {
+                live -= sizes[freed];
+            }
+            released[record - trace_records] = freed;
+            continue;
+        }
+        if (record->op == TRACE_MMAP || record->op == TRACE_MUNMAP || record->op >= TRACE_OPS) {
+            continue;
+        }
+
+        size_t t = 0;
+        while (t < summary->traced_threads && traced[t] != record->thread) {
+            t++;
+        }
+        if (t == summary->traced_threads) {
+            traced = (uint32_t*)checked_realloc(traced, (t + 1) * sizeof(uint32_t));
+            traced[summary->traced_threads++] = record->thread;
+        }
+        ReplayThread* thread = &threads[t % (size_t)thread_count];
+
+        ReplayOp op = {REPLAY_ALLOC, (size_t)record->size, 0, 0, -1, -1};
+        if (record->op == TRACE_FREE || (record->op == TRACE_REALLOC && record->arg != 0)) {
+            if (record->op == TRACE_FREE) {
+                op.freed = table_take(&table, record->ptr);
+                if (op.freed >= 0) {
+                    live -= sizes[op.freed];
+                }
+            } else {
+                op.freed = released[record - trace_records];
+            }
+            if (op.freed < 0) {
+                summary->unknown++;
+                if (record->op == TRACE_FREE) {
+                    continue;
+                }
+            }
+        }
+        switch (record->op) {
+        case TRACE_FREE:
+            op.op = REPLAY_FREE;
+            break;
+        case TRACE_CALLOC:
+            op.zero = 1;
+            break;
+        case TRACE_MEMALIGN:
+            op.alignment = (size_t)record->arg;
+            break;
+        case TRACE_REALLOC:
+            if (op.freed >= 0) {
+                op.op = record->size == 0 ? REPLAY_FREE : REPLAY_RESIZE;
+            }
+            break;
+        default:
+            break;
+        }
+        if (op.op != REPLAY_FREE && record->ptr != 0) {
+            op.made = slot_count++;
+            sizes[op.made] = op.size;
+            long stale = table_put(&table, record->ptr, op.made);
+            if (stale >= 0) {
+                // The traced program freed it without a record, free it here too or it leaks in the replay
+                summary->reused++;
+                live -= sizes[stale];
+                add_op(thread, (ReplayOp){REPLAY_FREE, 0, 0, 0, stale, -1});
+                summary->ops++;
+            }
+            live += op.size;
+            if (live > summary->peak_bytes) {
+                summary->peak_bytes = live;
+            }
+        } else if (op.op != REPLAY_FREE) {
+            continue;  // The traced program did not get a block either
+        }
+        add_op(thread, op);
+        summary->ops++;
+    }
+    free(traced);
+    free(released);
+    free(sizes);
+    free(table.keys);
+    free(table.values);
+    free(order);
+    free(trace_records);
+    return (size_t)slot_count;
+}
+
+/*Replay
+*
+*A replay thread makes its calls in order, timing each. One that needs a block another thread has yet to allocate
+*yields until it is there; the wait is not part of the call's time.
+*/
+static void* await_block(long slot) {
+    void* block;
+    while ((block = __atomic_load_n(&slots[slot], __ATOMIC_ACQUIRE)) == NULL) {
+        sched_yield();
+    }
+    return block;
+}
+
+static void* replay_thread(void* arg) {
+    ReplayThread* thread = (ReplayThread*)arg;
+    for (size_t i = 0; i < thread->count; i++) {
+        ReplayOp* op = &thread->ops[i];
+        void* old = op->freed >= 0 ? await_block(op->freed) : NULL;
+        if (old == &failed_block) {
+            old = NULL;  // Its allocation failed, treat the block as never made
+            if (op->op == REPLAY_FREE) {
+                continue;
+            }
+        }
+
+        void* block = NULL;
+        unsigned long long start = mem_now_ns();
+        switch (op->op) {
+        case REPLAY_ALLOC:
+            block = op->alignment > 0 ? mem_alloc_aligned(op->size, op->alignment) : mem_alloc(op->size);
+            if (block != NULL && op->zero) {
+                memset(block, 0, op->size);
+            }
+            break;
+        case REPLAY_FREE:
+            mem_free(old);
+            break;
+        case REPLAY_RESIZE:
+            block = mem_resize(old, op->size);
+            if (block == NULL && old != NULL) {
+                mem_free(old);  // The traced program got a new block, this one will not be freed
+            }
+            break;
+        default:
+            break;
+        }
+        thread->latency[op->op][mem_histogram_bucket(mem_now_ns() - start)]++;
+
+        if (op->made >= 0) {
+            if (block == NULL) {
+                thread->failed++;
+                block = &failed_block;
+            }
+            __atomic_store_n(&slots[op->made], block, __ATOMIC_RELEASE);
+        }
+    }
+    __atomic_add_fetch(&replay_finished, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void usage(const char* name) {
+    fprintf(stderr, "Usage: %s [-t threads] [-s pool bytes] [-m max pool bytes] [-a arenas] "
+                    "[-f segregated|best|first|next|bitmap] [-b] <trace file>\n", name);
+    exit(1);
+}
+
+int main(int argc, char* argv[]) {
+    int thread_count = 1;
+    size_t pool_size = 0;
+    mem_options_t options;
+    memset(&options, 0, sizeof(options));
+    const char* fit_names[] = {"segregated", "best", "first", "next", "bitmap"};
+
+    int option;
+    while ((option = getopt(argc, argv, "t:s:m:a:f:b")) != -1) {
+        switch (option) {
+        case 't':
+            thread_count = atoi(optarg);
+            break;
+        case 's':
+            pool_size = (size_t)strtoull(optarg, NULL, 0);
+            break;
+        case 'm':
+            options.max_size = (size_t)strtoull(optarg, NULL, 0);
+            break;
+        case 'a':
+            options.arenas = atoi(optarg);
+            break;
+        case 'f':
+            options.fit = MEM_FIT_SEGREGATED;
+            while (options.fit <= MEM_FIT_BITMAP && strcmp(optarg, fit_names[options.fit]) != 0) {
+                options.fit++;
+            }
+            if (options.fit > MEM_FIT_BITMAP) {
+                usage(argv[0]);
+            }
+            break;
+        case 'b':
+            options.backend = MEM_BACKEND_BUDDY;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || thread_count < 1) {
+        usage(argv[0]);
+    }
+
+    ReplayThread* threads = (ReplayThread*)calloc((size_t)thread_count, sizeof(ReplayThread));
+    if (threads == NULL) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        return 1;
+    }
+    TraceSummary summary;
+    memset(&summary, 0, sizeof(summary));
+    size_t slot_count = load_trace(argv[optind], threads, thread_count, &summary);
+    slots = (void**)calloc(slot_count + 1, sizeof(void*));
+    if (slots == NULL) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        return 1;
+    }
+
+    // By default twice what the traced program had at its peak, rounding and fragmentation take some of it
+    if (pool_size == 0) {
+        pool_size = summary.peak_bytes * 2 > 1024 * 1024 ? summary.peak_bytes * 2 : 1024 * 1024;
+    }
+    if (mem_init_with(pool_size, &options) != 0) {
+        fprintf(stderr, "Error: Cannot create a pool of %zu bytes.\n", pool_size);
+        return 1;
+    }
+
+    unsigned long long start = mem_now_ns();
+    for (int i = 0; i < thread_count; i++) {
+        pthread_create(&threads[i].thread, NULL, replay_thread, &threads[i]);
+    }
+
+    // Sample the pool while the replay runs, the peak in use is not known otherwise
+    size_t peak_used = 0;
+    double worst_fragmentation = 0.0;
+    double fragmentation_sum = 0.0;
+    int samples = 0;
+    struct timespec pause = {0, REPLAY_SAMPLE_NS};
+    while (__atomic_load_n(&replay_finished, __ATOMIC_ACQUIRE) < thread_count) {
+        nanosleep(&pause, NULL);
+        mem_stats_t stats = mem_stats();
+        peak_used = stats.used_bytes > peak_used ? stats.used_bytes : peak_used;
+        worst_fragmentation = stats.fragmentation > worst_fragmentation ? stats.fragmentation : worst_fragmentation;
+        fragmentation_sum += stats.fragmentation;
+        samples++;
+    }
+    for (int i = 0; i < thread_count; i++) {
+        pthread_join(threads[i].thread, NULL);
+    }
+    unsigned long long elapsed = mem_now_ns() - start;
+    mem_stats_t stats = mem_stats();
+    peak_used = stats.used_bytes > peak_used ? stats.used_bytes : peak_used;
+
+    unsigned long long latency[REPLAY_OPS][MEM_PROFILE_BUCKETS];
+    memset(latency, 0, sizeof(latency));
+    unsigned long long failed = 0;
+    for (int i = 0; i < thread_count; i++) {
+        for (int op = 0; op < REPLAY_OPS; op++) {
+            for (int b = 0; b < MEM_PROFILE_BUCKETS; b++) {
+                latency[op][b] += threads[i].latency[op][b];
+            }
+        }
+        failed += threads[i].failed;
+        free(threads[i].ops);
+    }
+
+    printf("Trace: %zu records, %zu threads, %zu calls replayed on %d threads\n", summary.records,
+           summary.traced_threads, summary.ops, thread_count);
+    if (summary.unknown > 0 || summary.reused > 0) {
+        printf("Warning: %zu frees or resizes of unknown blocks skipped, %zu live addresses allocated again.\n",
+               summary.unknown, summary.reused);
+    }
+    printf("Time: %.3f ms, %.0f calls/s\n", (double)elapsed / 1e6,
+           elapsed > 0 ? (double)summary.ops * 1e9 / (double)elapsed : 0.0);
+    printf("%-8s %12s %10s %10s %10s %10s %10s\n", "ns", "count", "p50", "p90", "p99", "p99.9", "max");
+    for (int op = 0; op < REPLAY_OPS; op++) {
+        unsigned long long calls = 0;
+        for (int b = 0; b < MEM_PROFILE_BUCKETS; b++) {
+            calls += latency[op][b];
+        }
+        printf("%-8s %12llu %10llu %10llu %10llu %10llu %10llu\n", replay_op_names[op], calls,
+               mem_histogram_percentile(latency[op], 0.5), mem_histogram_percentile(latency[op], 0.9), mem_histogram_percentile(latency[op], 0.99),
+               mem_histogram_percentile(latency[op], 0.999), mem_histogram_percentile(latency[op], 1.0));
+    }
+    printf("Pool: %zu bytes asked for, %zu at the end, peak in use %zu, peak allocated %lld (traced program: %zu)\n",
+           pool_size, stats.size, peak_used, stats.peak_bytes, summary.peak_bytes);
+    printf("Fragmentation: %.3f at the end, %.3f on average, %.3f at worst\n", stats.fragmentation,
+           samples > 0 ? fragmentation_sum / samples : stats.fragmentation, worst_fragmentation);
+    printf("Failed allocations: %llu\n", failed);
+
+    mem_deinit();
+    free(slots);
+    free(threads);
+    return failed > 0 ? 2 : 0;
+}